@@ -0,0 +1,291 @@
+#pragma once
+
+#include "memory_budget.hpp"
+#include "tape.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace external_sort
+{
+namespace detail
+{
+
+/*
+ * Background thread doing all tape I/O of a merge, so tapes are never touched by two threads
+ * at once even when runs share a tape. Urgent requests (writes, flushes and reads somebody is
+ * already waiting for) are served first in FIFO order. Prefetch reads are served in forecast
+ * order: the run whose current block ends with the smallest key will run dry first, so its next
+ * block is read first.
+ */
+template<typename Value>
+class AsyncIo
+{
+public:
+    AsyncIo()
+        : thread_{ [this] { work(); } } {}
+
+    AsyncIo(AsyncIo const &) = delete;
+    AsyncIo & operator=(AsyncIo const &) = delete;
+
+    ~AsyncIo() {
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            stopping_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    std::future<std::size_t> read(Tape<Value> * tape, std::size_t offset, Value * buffer,
+                                  std::size_t count) {
+        return submitUrgent([=] {
+            tape->pos(offset);
+            return tape->readBlock(buffer, count);
+        });
+    }
+
+    std::future<std::size_t> prefetch(Tape<Value> * tape, std::size_t offset, Value * buffer,
+                                      std::size_t count, Value forecast) {
+        Prefetch request{ std::move(forecast), tape, offset, buffer, count, {} };
+        auto result = request.done.get_future();
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            prefetches_.push_back(std::move(request));
+            std::push_heap(prefetches_.begin(), prefetches_.end(), laterForecast);
+        }
+        ready_.notify_one();
+        return result;
+    }
+
+    std::future<std::size_t> write(Tape<Value> * tape, std::size_t offset, Value const * data,
+                                   std::size_t count) {
+        return submitUrgent([=] {
+            tape->pos(offset);
+            tape->writeBlock(data, count);
+            return count;
+        });
+    }
+
+    std::future<std::size_t> flush(Tape<Value> * tape) {
+        return submitUrgent([=] {
+            tape->flush();
+            return std::size_t(0);
+        });
+    }
+
+private:
+    struct Prefetch
+    {
+        Value forecast;
+        Tape<Value> * tape;
+        std::size_t offset;
+        Value * buffer;
+        std::size_t count;
+        std::promise<std::size_t> done;
+    };
+
+    static bool laterForecast(Prefetch const & a, Prefetch const & b) {
+        return b.forecast < a.forecast;
+    }
+
+    template<typename F>
+    std::future<std::size_t> submitUrgent(F && task) {
+        std::packaged_task<std::size_t()> packaged{ std::forward<F>(task) };
+        auto result = packaged.get_future();
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            urgent_.push_back(std::move(packaged));
+        }
+        ready_.notify_one();
+        return result;
+    }
+
+    void work() {
+        for (;;) {
+            std::unique_lock<std::mutex> lock{ mutex_ };
+            ready_.wait(lock,
+                        [this] { return stopping_ || !urgent_.empty() || !prefetches_.empty(); });
+            if (!urgent_.empty()) {
+                auto task = std::move(urgent_.front());
+                urgent_.pop_front();
+                lock.unlock();
+                task();
+            } else if (!prefetches_.empty()) {
+                std::pop_heap(prefetches_.begin(), prefetches_.end(), laterForecast);
+                Prefetch request = std::move(prefetches_.back());
+                prefetches_.pop_back();
+                lock.unlock();
+                try {
+                    request.tape->pos(request.offset);
+                    request.done.set_value(request.tape->readBlock(request.buffer, request.count));
+                } catch (...) {
+                    request.done.set_exception(std::current_exception());
+                }
+            } else {
+                return;
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::packaged_task<std::size_t()>> urgent_;
+    std::vector<Prefetch> prefetches_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+/*
+ * Double buffered RunReader: while the merge consumes the current block, the next one is
+ * prefetched by the I/O thread, forecast by the last key of the current block. A reversed run
+ * is read from its end like with RunReader.
+ */
+template<typename Value>
+class AsyncRunReader
+{
+public:
+    using value_type = Value;
+
+    AsyncRunReader(AsyncIo<Value> & io, Tape<Value> * tape, std::size_t offset, std::size_t size,
+                   std::size_t blockSize, MemoryBudget * budget = nullptr, bool reversed = false)
+        : io_{ &io }
+        , tape_{ tape }
+        , next_{ reversed ? offset + size : offset }
+        , remaining_{ size }
+        , reversed_{ reversed }
+        , current_(BudgetAllocator<Value>{ budget })
+        , spare_(BudgetAllocator<Value>{ budget }) {
+        std::size_t const block = std::max<std::size_t>(1, std::min(blockSize, size));
+        current_.resize(block);
+        spare_.resize(block);
+        if (remaining_ != 0) {
+            std::size_t const n = std::min(current_.size(), remaining_);
+            pending_ = io_->read(tape_, take(n), spare_.data(), n);
+            swap();
+        }
+    }
+
+    AsyncRunReader(AsyncRunReader &&) = default;
+
+    ~AsyncRunReader() {
+        // The I/O thread may still be filling the spare buffer.
+        if (pending_.valid())
+            pending_.wait();
+    }
+
+    bool empty() const { return cursor_ == buffered_; }
+
+    Value const & head() const { return current_[cursor_]; }
+
+    void next() {
+        if (++cursor_ == buffered_ && pending_.valid())
+            swap();
+    }
+
+private:
+    // Tape offset of the next n values of the run.
+    std::size_t take(std::size_t n) {
+        remaining_ -= n;
+        if (reversed_)
+            return next_ -= n;
+        next_ += n;
+        return next_ - n;
+    }
+
+    void swap() {
+        std::size_t const got = pending_.get();
+        if (got == 0)
+            throw std::runtime_error("Unexpected end of tape");
+        std::swap(current_, spare_);
+        if (reversed_)
+            std::reverse(current_.begin(), current_.begin() + got);
+        buffered_ = got;
+        cursor_ = 0;
+        if (remaining_ != 0) {
+            std::size_t const n = std::min(spare_.size(), remaining_);
+            pending_ = io_->prefetch(tape_, take(n), spare_.data(), n, current_[buffered_ - 1]);
+        }
+    }
+
+    AsyncIo<Value> * io_;
+    Tape<Value> * tape_;
+    std::size_t next_;
+    std::size_t remaining_;
+    bool reversed_;
+    Buffer<Value> current_;
+    Buffer<Value> spare_;
+    std::future<std::size_t> pending_;
+    std::size_t cursor_ = 0;
+    std::size_t buffered_ = 0;
+};
+
+/*
+ * Double buffered RunWriter: a full block is handed to the I/O thread and the merge goes on
+ * filling the other one.
+ */
+template<typename Value>
+class AsyncRunWriter
+{
+public:
+    AsyncRunWriter(AsyncIo<Value> & io, Tape<Value> * tape, std::size_t offset,
+                   std::size_t blockSize, MemoryBudget * budget = nullptr)
+        : io_{ &io }
+        , tape_{ tape }
+        , next_{ offset }
+        , blockSize_{ std::max<std::size_t>(1, blockSize) }
+        , current_(BudgetAllocator<Value>{ budget })
+        , spare_(BudgetAllocator<Value>{ budget }) {
+        current_.reserve(blockSize_);
+        spare_.reserve(blockSize_);
+    }
+
+    ~AsyncRunWriter() {
+        if (pending_.valid())
+            pending_.wait();
+    }
+
+    void push(Value value) {
+        current_.emplace_back(std::move(value));
+        if (current_.size() == blockSize_)
+            flushBlock();
+    }
+
+    void finish() {
+        flushBlock();
+        if (pending_.valid())
+            pending_.get();
+        io_->flush(tape_).get();
+    }
+
+private:
+    void flushBlock() {
+        if (current_.empty())
+            return;
+        if (pending_.valid())
+            pending_.get();
+        pending_ = io_->write(tape_, next_, current_.data(), current_.size());
+        next_ += current_.size();
+        std::swap(current_, spare_);
+        current_.clear();
+    }
+
+    AsyncIo<Value> * io_;
+    Tape<Value> * tape_;
+    std::size_t next_;
+    std::size_t blockSize_;
+    Buffer<Value> current_;
+    Buffer<Value> spare_;
+    std::future<std::size_t> pending_;
+};
+
+}  // namespace detail
+}  // namespace external_sort
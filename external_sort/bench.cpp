@@ -0,0 +1,154 @@
+#include "external_sort.hpp"
+#include "file_tape.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+/*
+ * Sorts a file of fixed-size records through file backed tapes and reports the throughput:
+ * ./external_sort_bench [size in MiB = 4096] [record size: 8 or 64 = 8] [threads = 0] [scratch dir]
+ *                      [run codec: none or delta = none]
+ */
+
+namespace
+{
+
+struct Record64
+{
+    std::uint64_t key;
+    std::uint64_t payload[7];
+
+    bool operator<(Record64 const & other) const { return key < other.key; }
+};
+
+std::uint64_t keyOf(std::uint64_t value) {
+    return value;
+}
+
+std::uint64_t keyOf(Record64 const & value) {
+    return value.key;
+}
+
+void makeRecord(std::uint64_t key, std::uint64_t & value) {
+    value = key;
+}
+
+void makeRecord(std::uint64_t key, Record64 & value) {
+    value.key = key;
+    for (std::size_t i = 0; i < 7; ++i)
+        value.payload[i] = key + i;
+}
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds(clock_type::time_point since) {
+    return std::chrono::duration<double>(clock_type::now() - since).count();
+}
+
+template<typename Value>
+int bench(std::size_t sizeMiB, std::size_t threads, std::string const & dir,
+          external_sort::RunCodec codec) {
+    constexpr std::size_t kMaxMemorySize = 256ULL * 1024 * 1024;
+    constexpr std::size_t kBatch = 1024 * 1024;
+
+    std::size_t const records = sizeMiB * 1024 * 1024 / sizeof(Value);
+    double const gigabytes = double(records * sizeof(Value)) / 1e9;
+    std::string const inPath = dir + "/external_sort_bench.in";
+    std::string const outPath = dir + "/external_sort_bench.out";
+
+    std::uint64_t inputChecksum = 0;
+    auto start = clock_type::now();
+    {
+        external_sort::FileTape<Value> in{ inPath, external_sort::OpenMode::Write };
+        std::mt19937_64 rng{ 42 };
+        std::vector<Value> batch(kBatch);
+        for (std::size_t done = 0; done < records;) {
+            std::size_t const n = std::min(kBatch, records - done);
+            for (std::size_t i = 0; i < n; ++i) {
+                makeRecord(rng(), batch[i]);
+                inputChecksum += keyOf(batch[i]);
+            }
+            in.writeBlock(batch.data(), n);
+            done += n;
+        }
+        in.flush();
+    }
+    std::cout << "generate: " << gigabytes << " GB in " << seconds(start) << " s" << std::endl;
+
+    {
+        std::unique_ptr<external_sort::Tape<Value>> in =
+            std::make_unique<external_sort::MmapTape<Value>>(inPath);
+        std::unique_ptr<external_sort::Tape<Value>> out =
+            std::make_unique<external_sort::FileTape<Value>>(outPath,
+                                                             external_sort::OpenMode::Write);
+        auto tmp = external_sort::makeTemporaryTapes<Value>(4, dir);
+
+        external_sort::SortOptions options;
+        options.threads = threads;
+        options.runCodec = codec;
+        external_sort::SortStats stats;
+        options.stats = &stats;
+        start = clock_type::now();
+        external_sort::externalSort<Value, kMaxMemorySize>(in, out, tmp, options);
+        double const elapsed = seconds(start);
+        std::cout << "sort: " << gigabytes << " GB in " << elapsed << " s, "
+                  << gigabytes / elapsed << " GB/s" << std::endl;
+        for (auto const & phase : stats.phases) {
+            std::cout << "  " << phase.name << ": " << phase.wallSeconds << " s, "
+                      << phase.valuesRead << " read, " << phase.valuesWritten << " written, "
+                      << phase.runs << " runs" << std::endl;
+        }
+        std::cout << "  peak memory: " << stats.peakMemoryBytes << " bytes" << std::endl;
+    }
+
+    bool ok = true;
+    {
+        external_sort::MmapTape<Value> out{ outPath };
+        std::uint64_t outputChecksum = 0;
+        Value const * data = out.data();
+        for (std::size_t i = 0; i < out.size(); ++i) {
+            outputChecksum += keyOf(data[i]);
+            if (i != 0 && data[i] < data[i - 1])
+                ok = false;
+        }
+        ok = ok && out.size() == records && outputChecksum == inputChecksum;
+    }
+    std::cout << "verify: " << (ok ? "ok" : "FAILED") << std::endl;
+
+    ::unlink(inPath.c_str());
+    ::unlink(outPath.c_str());
+    return ok ? 0 : 1;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+    std::size_t const sizeMiB = argc > 1 ? std::stoull(argv[1]) : 4096;
+    std::size_t const recordSize = argc > 2 ? std::stoull(argv[2]) : 8;
+    std::size_t const threads = argc > 3 ? std::stoull(argv[3]) : 0;
+    std::string const dir = argc > 4 ? argv[4] : external_sort::defaultTemporaryDirectory();
+    std::string const codecName = argc > 5 ? argv[5] : "none";
+
+    external_sort::RunCodec codec;
+    if (codecName == "none") {
+        codec = external_sort::RunCodec::None;
+    } else if (codecName == "delta") {
+        codec = external_sort::RunCodec::Delta;
+    } else {
+        std::cerr << "run codec must be none or delta" << std::endl;
+        return 2;
+    }
+
+    if (recordSize == 8)
+        return bench<std::uint64_t>(sizeMiB, threads, dir, codec);
+    if (recordSize == 64)
+        return bench<Record64>(sizeMiB, threads, dir, codec);
+    std::cerr << "record size must be 8 or 64" << std::endl;
+    return 2;
+}
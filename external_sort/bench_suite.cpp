@@ -0,0 +1,434 @@
+#include "external_sort.hpp"
+#include "file_tape.hpp"
+#include "record_sort.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Benchmark suite: generates a dataset per key distribution and size, sorts it once for every
+ * memory budget and fan-in of the sweep through file backed tapes, verifies every output, and
+ * writes the results as JSON.
+ *
+ * ./external_sort_suite [name=value]...
+ *   sizes=64,1024             dataset sizes in MiB
+ *   distributions=uniform,zipf,sorted,reverse,few-unique,strings
+ *   memory=16,256             memory budgets in MiB
+ *   fan-in=0,16               maximum fan-ins, 0 for as many as the memory allows
+ *   threads=0  codec=none  seed=42  dir=$TMPDIR  output=-   (- for stdout)
+ *
+ * Numbers are 8 byte keys; strings are length-prefixed records of 8 to 40 random letters,
+ * sorted by externalSortRecords(), which has no per-phase stats. The output is checked to be
+ * ordered and to hold the same multiset of records as the input, through an order-independent
+ * checksum. Progress goes to stderr; the exit status is 1 if any output failed verification.
+ */
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds(clock_type::time_point since) {
+    return std::chrono::duration<double>(clock_type::now() - since).count();
+}
+
+constexpr std::size_t kMiB = 1024 * 1024;
+constexpr std::size_t kBatch = 1024 * 1024;
+
+struct Config
+{
+    std::vector<std::size_t> sizesMiB{ 64, 1024 };
+    std::vector<std::string> distributions{ "uniform", "zipf",       "sorted",
+                                            "reverse", "few-unique", "strings" };
+    std::vector<std::size_t> memoryMiB{ 16, 256 };
+    std::vector<std::size_t> fanIns{ 0, 16 };
+    std::size_t threads = 0;
+    external_sort::RunCodec codec = external_sort::RunCodec::None;
+    std::uint64_t seed = 42;
+    std::string dir = external_sort::defaultTemporaryDirectory();
+    std::string output = "-";
+};
+
+template<typename T, typename Parse>
+std::vector<T> parseList(std::string const & list, Parse parse) {
+    std::vector<T> result;
+    std::stringstream stream{ list };
+    for (std::string item; std::getline(stream, item, ',');)
+        result.push_back(parse(item));
+    return result;
+}
+
+Config parseArgs(int argc, char ** argv) {
+    auto const toSize = [](std::string const & text) { return std::size_t(std::stoull(text)); };
+    auto const toString = [](std::string const & text) { return text; };
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        std::size_t const eq = arg.find('=');
+        if (eq == std::string::npos)
+            throw std::runtime_error("Expected name=value, got " + arg);
+        std::string const name = arg.substr(0, eq);
+        std::string const value = arg.substr(eq + 1);
+        if (name == "sizes")
+            config.sizesMiB = parseList<std::size_t>(value, toSize);
+        else if (name == "distributions")
+            config.distributions = parseList<std::string>(value, toString);
+        else if (name == "memory")
+            config.memoryMiB = parseList<std::size_t>(value, toSize);
+        else if (name == "fan-in")
+            config.fanIns = parseList<std::size_t>(value, toSize);
+        else if (name == "threads")
+            config.threads = toSize(value);
+        else if (name == "seed")
+            config.seed = std::stoull(value);
+        else if (name == "dir")
+            config.dir = value;
+        else if (name == "output")
+            config.output = value;
+        else if (name == "codec" && (value == "none" || value == "delta"))
+            config.codec =
+                value == "none" ? external_sort::RunCodec::None : external_sort::RunCodec::Delta;
+        else
+            throw std::runtime_error("Unknown option " + arg);
+    }
+    return config;
+}
+
+// splitmix64 finalizer: a well mixed hash of a key, summed into order-independent checksums.
+std::uint64_t mix(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+std::uint64_t hashBytes(std::string_view bytes) {
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : bytes)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+    return mix(hash);
+}
+
+/*
+ * Zipf distributed ranks in [0, n) with exponent s, by inverting the continuous approximation
+ * of its CDF, so no table is needed. Ranks are scattered over the key space by an odd
+ * multiplier, which keeps the hot keys from being the smallest ones.
+ */
+class Zipf
+{
+public:
+    Zipf(std::uint64_t n, double s)
+        : n_{ double(n) }
+        , s_{ s } {}
+
+    template<typename Rng>
+    std::uint64_t operator()(Rng & rng) {
+        double const u = std::uniform_real_distribution<double>{ 0, 1 }(rng);
+        // CDF(x) ~ (x^(1 - s) - 1) / (n^(1 - s) - 1), and log(x) / log(n) for s == 1.
+        double const x = s_ == 1 ? std::pow(n_, u)
+                                 : std::pow(u * (std::pow(n_, 1 - s_) - 1) + 1, 1 / (1 - s_));
+        auto const rank = std::min(std::uint64_t(x) - 1, std::uint64_t(n_) - 1);
+        return rank * 0x9e3779b97f4a7c15ULL;
+    }
+
+private:
+    double n_;
+    double s_;
+};
+
+struct Dataset
+{
+    std::string path;
+    std::size_t records = 0;
+    std::size_t bytes = 0;
+    std::uint64_t checksum = 0;
+};
+
+Dataset generateNumbers(std::string const & distribution, std::size_t sizeMiB,
+                        Config const & config) {
+    Dataset dataset;
+    dataset.path = config.dir + "/external_sort_suite.in";
+    dataset.records = sizeMiB * kMiB / sizeof(std::uint64_t);
+    dataset.bytes = dataset.records * sizeof(std::uint64_t);
+    std::size_t const n = dataset.records;
+
+    std::mt19937_64 rng{ config.seed };
+    Zipf zipf{ 1000000, 1.0 };
+    std::uint64_t const step = n == 0 ? 1 : ~std::uint64_t(0) / n;
+    auto const next = [&](std::size_t i) -> std::uint64_t {
+        if (distribution == "uniform")
+            return rng();
+        if (distribution == "zipf")
+            return zipf(rng);
+        if (distribution == "sorted")
+            return i * step;
+        if (distribution == "reverse")
+            return (n - i) * step;
+        if (distribution == "few-unique")
+            return mix(rng() % 16);
+        throw std::runtime_error("Unknown distribution " + distribution);
+    };
+
+    external_sort::FileTape<std::uint64_t> in{ dataset.path, external_sort::OpenMode::Write };
+    std::vector<std::uint64_t> batch(kBatch);
+    for (std::size_t done = 0; done < n;) {
+        std::size_t const count = std::min(kBatch, n - done);
+        for (std::size_t i = 0; i < count; ++i) {
+            batch[i] = next(done + i);
+            dataset.checksum += mix(batch[i]);
+        }
+        in.writeBlock(batch.data(), count);
+        done += count;
+    }
+    in.flush();
+    return dataset;
+}
+
+Dataset generateStrings(std::size_t sizeMiB, Config const & config) {
+    Dataset dataset;
+    dataset.path = config.dir + "/external_sort_suite.in";
+    std::mt19937_64 rng{ config.seed };
+    std::uniform_int_distribution<std::size_t> length{ 8, 40 };
+    std::uniform_int_distribution<int> letter{ 'a', 'z' };
+
+    external_sort::FileTape<char> in{ dataset.path, external_sort::OpenMode::Write };
+    std::string batch;
+    std::string record;
+    while (dataset.bytes < sizeMiB * kMiB) {
+        record.resize(length(rng));
+        for (char & c : record)
+            c = char(letter(rng));
+        auto const prefix = external_sort::RecordLength(record.size());
+        batch.append(reinterpret_cast<char const *>(&prefix), sizeof(prefix));
+        batch.append(record);
+        dataset.bytes += sizeof(prefix) + record.size();
+        dataset.checksum += hashBytes(record);
+        ++dataset.records;
+        if (batch.size() >= kBatch) {
+            in.writeBlock(batch.data(), batch.size());
+            batch.clear();
+        }
+    }
+    in.writeBlock(batch.data(), batch.size());
+    in.flush();
+    return dataset;
+}
+
+bool verifyNumbers(std::string const & path, Dataset const & dataset) {
+    external_sort::MmapTape<std::uint64_t> out{ path };
+    std::uint64_t const * data = out.data();
+    std::uint64_t checksum = 0;
+    for (std::size_t i = 0; i < out.size(); ++i) {
+        if (i != 0 && data[i] < data[i - 1])
+            return false;
+        checksum += mix(data[i]);
+    }
+    return out.size() == dataset.records && checksum == dataset.checksum;
+}
+
+bool verifyStrings(std::string const & path, Dataset const & dataset) {
+    external_sort::MmapTape<char> out{ path };
+    char const * data = out.data();
+    std::size_t offset = 0;
+    std::size_t records = 0;
+    std::uint64_t checksum = 0;
+    std::string_view previous;
+    while (offset + sizeof(external_sort::RecordLength) <= out.size()) {
+        external_sort::RecordLength length;
+        std::memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+        if (offset + length > out.size())
+            return false;
+        std::string_view const record{ data + offset, length };
+        offset += length;
+        if (records != 0 && record < previous)
+            return false;
+        checksum += hashBytes(record);
+        previous = record;
+        ++records;
+    }
+    return offset == out.size() && records == dataset.records && checksum == dataset.checksum;
+}
+
+struct Result
+{
+    std::string distribution;
+    std::size_t memoryBytes = 0;
+    std::size_t maxFanIn = 0;
+    double seconds = 0;
+    bool verified = false;
+    std::string error;
+    external_sort::SortStats stats;
+};
+
+Result runSort(std::string const & distribution, Dataset const & dataset, std::size_t memoryMiB,
+               std::size_t maxFanIn, Config const & config) {
+    Result result;
+    result.distribution = distribution;
+    result.memoryBytes = memoryMiB * kMiB;
+    result.maxFanIn = maxFanIn;
+
+    external_sort::SortOptions options;
+    options.memoryBytes = result.memoryBytes;
+    options.maxFanIn = maxFanIn;
+    options.threads = config.threads;
+    options.runCodec = config.codec;
+    options.stats = &result.stats;
+
+    std::string const outPath = config.dir + "/external_sort_suite.out";
+    try {
+        auto start = clock_type::now();
+        if (distribution == "strings") {
+            std::unique_ptr<external_sort::Tape<char>> in =
+                std::make_unique<external_sort::MmapTape<char>>(dataset.path);
+            std::unique_ptr<external_sort::Tape<char>> out =
+                std::make_unique<external_sort::FileTape<char>>(outPath,
+                                                                external_sort::OpenMode::Write);
+            auto tmp = external_sort::makeTemporaryTapes<char>(4, config.dir);
+            external_sort::externalSortRecords(in, out, tmp, options);
+            result.seconds = seconds(start);
+        } else {
+            std::unique_ptr<external_sort::Tape<std::uint64_t>> in =
+                std::make_unique<external_sort::MmapTape<std::uint64_t>>(dataset.path);
+            std::unique_ptr<external_sort::Tape<std::uint64_t>> out =
+                std::make_unique<external_sort::FileTape<std::uint64_t>>(
+                    outPath, external_sort::OpenMode::Write);
+            auto tmp = external_sort::makeTemporaryTapes<std::uint64_t>(4, config.dir);
+            external_sort::externalSort<std::uint64_t>(in, out, tmp, options);
+            result.seconds = seconds(start);
+        }
+        result.verified = distribution == "strings" ? verifyStrings(outPath, dataset)
+                                                    : verifyNumbers(outPath, dataset);
+    } catch (std::exception const & e) {
+        result.error = e.what();
+    }
+    ::unlink(outPath.c_str());
+    return result;
+}
+
+std::string quoted(std::string const & text) {
+    std::string result = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+            result += ' ';
+        else
+            result += c;
+    }
+    return result + "\"";
+}
+
+double perSecond(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+/*
+ * Throughput of every phase: run formation goes at the pace of the records it reads, the
+ * merges at the pace of the records they write.
+ */
+void writePhases(std::ostream & json, external_sort::SortStats const & stats) {
+    json << "[";
+    for (std::size_t i = 0; i < stats.phases.size(); ++i) {
+        auto const & phase = stats.phases[i];
+        std::size_t const records =
+            phase.name == "run formation" ? phase.valuesRead : phase.valuesWritten;
+        double const megabytes = double(records * sizeof(std::uint64_t)) / kMiB;
+        json << (i == 0 ? "" : ",") << "\n        {\"name\": " << quoted(phase.name)
+             << ", \"seconds\": " << phase.wallSeconds << ", \"cpu_seconds\": " << phase.cpuSeconds
+             << ", \"records\": " << records << ", \"records_read\": " << phase.valuesRead
+             << ", \"records_written\": " << phase.valuesWritten << ", \"runs\": " << phase.runs
+             << ", \"comparisons\": " << phase.comparisons
+             << ", \"records_per_s\": " << perSecond(double(records), phase.wallSeconds)
+             << ", \"mb_per_s\": " << perSecond(megabytes, phase.wallSeconds) << "}";
+    }
+    json << (stats.phases.empty() ? "]" : "\n      ]");
+}
+
+void writeResult(std::ostream & json, Result const & result, Dataset const & dataset,
+                 Config const & config) {
+    double const megabytes = double(dataset.bytes) / kMiB;
+    json << "    {\"distribution\": " << quoted(result.distribution)
+         << ", \"records\": " << dataset.records << ", \"bytes\": " << dataset.bytes
+         << ", \"memory_bytes\": " << result.memoryBytes << ", \"max_fan_in\": " << result.maxFanIn
+         << ", \"threads\": " << config.threads << ", \"codec\": "
+         << (config.codec == external_sort::RunCodec::None ? "\"none\"" : "\"delta\"")
+         << ",\n     \"seconds\": " << result.seconds
+         << ", \"records_per_s\": " << perSecond(double(dataset.records), result.seconds)
+         << ", \"mb_per_s\": " << perSecond(megabytes, result.seconds)
+         << ", \"runs\": " << result.stats.runs
+         << ", \"natural_runs\": " << result.stats.naturalRuns
+         << ", \"comparisons\": " << result.stats.comparisons
+         << ", \"peak_memory_bytes\": " << result.stats.peakMemoryBytes
+         << ", \"verified\": " << (result.verified ? "true" : "false");
+    if (!result.error.empty())
+        json << ", \"error\": " << quoted(result.error);
+    json << ",\n     \"phases\": ";
+    writePhases(json, result.stats);
+    json << "}";
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+    Config config;
+    try {
+        config = parseArgs(argc, argv);
+    } catch (std::exception const & e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    std::ofstream file;
+    if (config.output != "-")
+        file.open(config.output);
+    std::ostream & json = config.output == "-" ? std::cout : file;
+    json << "{\n  \"seed\": " << config.seed << ",\n  \"results\": [\n";
+
+    bool ok = true;
+    bool first = true;
+    for (std::size_t sizeMiB : config.sizesMiB) {
+        for (auto const & distribution : config.distributions) {
+            Dataset dataset;
+            try {
+                auto start = clock_type::now();
+                dataset = distribution == "strings"
+                              ? generateStrings(sizeMiB, config)
+                              : generateNumbers(distribution, sizeMiB, config);
+                std::cerr << "generate " << distribution << " " << sizeMiB << " MiB: "
+                          << seconds(start) << " s" << std::endl;
+            } catch (std::exception const & e) {
+                std::cerr << e.what() << std::endl;
+                return 2;
+            }
+            for (std::size_t memoryMiB : config.memoryMiB) {
+                for (std::size_t fanIn : config.fanIns) {
+                    Result const result = runSort(distribution, dataset, memoryMiB, fanIn, config);
+                    std::cerr << "  memory " << memoryMiB << " MiB, fan-in " << fanIn << ": "
+                              << result.seconds << " s, "
+                              << (result.verified ? "ok" : "FAILED " + result.error) << std::endl;
+                    ok = ok && result.verified;
+                    json << (first ? "" : ",\n");
+                    writeResult(json, result, dataset, config);
+                    first = false;
+                }
+            }
+            ::unlink(dataset.path.c_str());
+        }
+    }
+    json << "\n  ]\n}\n";
+    return ok ? 0 : 1;
+}
@@ -1,160 +1,1518 @@
 #pragma once
 
+#include "async_io.hpp"
+#include "file_tape.hpp"
+#include "loser_tree.hpp"
+#include "memory_budget.hpp"
+#include "radix_sort.hpp"
+#include "run_codec.hpp"
+#include "segmented_tape.hpp"
+#include "shared_tape.hpp"
+#include "sort_stats.hpp"
+#include "tape.hpp"
+#include "thread_pool.hpp"
+
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
-#include <set>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 namespace external_sort
 {
 
+enum class MergeStrategy
+{
+    LinearScan,  // compares the heads of all runs for every output value, O(k)
+    LoserTree,   // tournament tree of losers, O(log k)
+};
+
+enum class RunGeneration
+{
+    Chunks,                // sorts memory sized chunks, every run is exactly one chunk long
+    ReplacementSelection,  // streams the input through a heap, runs average twice the memory
+};
+
+enum class RunCodec
+{
+    None,   // temporary runs hold raw values
+    Delta,  // varint coded key differences, for integral and floating point values only
+};
+
+struct SortOptions
+{
+    // Memory for the value buffers of the sort, in bytes. The overloads taking kMaxMemorySize
+    // as a template argument override it.
+    std::size_t memoryBytes = 64 * 1024 * 1024;
+    MergeStrategy mergeStrategy = MergeStrategy::LoserTree;
+    RunGeneration runGeneration = RunGeneration::Chunks;
+    // Workers sorting chunks during run formation while the caller keeps reading the input,
+    // only with Chunks. The final merge of raw runs is split into threads + 1 key ranges merged
+    // in parallel, unless asyncIo is set. 0 does all of it on the calling thread.
+    std::size_t threads = 0;
+    // Upper bound on the number of runs merged at once, 0 leaves it to the memory budget.
+    std::size_t maxFanIn = 0;
+    // Smallest buffer a run gets during a merge, the fan-in is lowered until every run has one.
+    std::size_t minBlockBytes = 64 * 1024;
+    // Merges read ahead and write behind on a background I/O thread. Every run and the output
+    // get two buffers, each half the size they would get otherwise. Merges of encoded runs
+    // don't use it.
+    bool asyncIo = false;
+    // Encoding of the temporary runs, in blocks of minBlockBytes. Ignored for value types it
+    // doesn't apply to.
+    RunCodec runCodec = RunCodec::None;
+    // Chunks that are already sorted, or reversed, are merged in place from the input instead of
+    // being sorted and stored, only with Chunks. The input is then read until the sort is done.
+    bool naturalRuns = true;
+    // Filled by externalSort() when set: time, I/O and comparisons per phase, I/O per tape and
+    // peak memory. Setting it or progress costs a counting layer around every tape.
+    SortStats * stats = nullptr;
+    // Called by externalSort() as every phase starts, advances by a hundredth and ends.
+    std::function<void(SortProgress const &)> progress;
+    // Temporary tapes created when none are passed in: how many, and in which directory, empty
+    // for defaultTemporaryDirectory().
+    std::size_t temporaryTapes = 4;
+    std::string temporaryDirectory;
+};
+
+// Combiner of externalSort() keeping the first of equivalent values, for deduplication.
+struct Unique
+{
+    template<typename Value>
+    void operator()(Value &, Value const &) const {}
+};
+
+namespace detail
+{
+
+// Value count standing for no limit.
+constexpr std::size_t kUnlimited = ~std::size_t(0);
+
+// Combiner of the sorts that keep every value.
+struct NoCombine
+{
+    template<typename Value>
+    void operator()(Value &, Value const &) const {}
+};
+
+template<typename Combine>
+constexpr bool kCombines = !std::is_same<Combine, NoCombine>::value;
+
+// Folds every group of equivalent values of a sorted range into its first one and returns the
+// end of the combined values.
+template<typename Value, typename Combine>
+Value * combineSorted(Value * first, Value * last, Combine & combine) {
+    if constexpr (kCombines<Combine>) {
+        if (first == last)
+            return last;
+        Value * out = first;
+        for (Value * p = first + 1; p != last; ++p) {
+            if (*out < *p)
+                *++out = std::move(*p);
+            else
+                combine(*out, *p);
+        }
+        return out + 1;
+    } else {
+        return last;
+    }
+}
+
+template<typename TapePtr>
+auto * rawTape(TapePtr & tape) {
+    return &*tape;
+}
+
+// A sorted run of count values stored in [offset, offset + size) of a tape. Encoded runs hold
+// more values than they take positions, raw runs exactly as many. Natural runs are read in place
+// from the input, always raw, and back to front when they are reversed. A spanned run is stored
+// on a SegmentedTape over the ends of several temporary tapes, which it owns, and tape points to.
+template<typename Value>
+struct Run
+{
+    Tape<Value> * tape;
+    std::size_t offset;
+    std::size_t size;
+    std::size_t count;
+    bool natural = false;
+    bool reversed = false;
+    std::shared_ptr<SegmentedTape<Value>> span;
+};
+
+// Tape offset of the values [first, first + count) of a raw run.
+template<typename Value>
+std::size_t runOffset(Run<Value> const & run, std::size_t first, std::size_t count) {
+    return run.reversed ? run.offset + run.size - first - count : run.offset + first;
+}
+
+// Values held by a RunReader or a RunWriter with these arguments, at most.
+template<typename Value>
+std::size_t bufferMemory(std::size_t blockSize, std::size_t codecBlock) {
+    if constexpr (kRadixSortable<Value>) {
+        if (codecBlock != 0) {
+            std::size_t const rest = blockSize > codecBlock ? blockSize - codecBlock : 0;
+            return codecBlock + std::max(DeltaCodec<Value>::blockBound(codecBlock), rest);
+        }
+    }
+    return std::max<std::size_t>(1, blockSize);
+}
+
+/*
+ * Values per encoded block of the temporary runs, 0 when they hold raw values. Blocks get an
+ * eighth of the memory at most; when even that leaves no room for the three buffers of a
+ * two-way merge, runs are stored raw.
+ */
+template<typename Value>
+std::size_t codecBlock(std::size_t memoryValues, SortOptions const & options) {
+    if (!kRadixSortable<Value> || options.runCodec == RunCodec::None)
+        return 0;
+    std::size_t const block =
+        std::max<std::size_t>(1, std::min(options.minBlockBytes / sizeof(Value), memoryValues / 8));
+    return 3 * bufferMemory<Value>(0, block) <= memoryValues ? block : 0;
+}
+
+// Tape positions a run of count values takes at most.
+template<typename Value>
+std::size_t runExtent(std::size_t count, std::size_t codecBlock) {
+    if constexpr (kRadixSortable<Value>) {
+        if (codecBlock != 0)
+            return DeltaCodec<Value>::extentBound(count, codecBlock);
+    }
+    return count;
+}
+
+// Tape positions count values split into runs runs take at most, with the partial last block
+// of every run.
+template<typename Value>
+std::size_t runsExtent(std::size_t count, std::size_t runs, std::size_t codecBlock) {
+    if constexpr (kRadixSortable<Value>) {
+        if (codecBlock != 0)
+            return runExtent<Value>(count, codecBlock) + runs * DeltaCodec<Value>::kHeaderSlots;
+    }
+    return count;
+}
+
+/*
+ * Temporary tapes used as append-only storage for runs. Runs are spread round-robin over the
+ * tapes that still have room for them. A run that no single tape has room for is spanned over
+ * the room left at the ends of several tapes, the emptiest first, so a group can hold as many
+ * values as its tapes together, whatever the sizes of the runs. reset() drops all of them at
+ * once after a merge pass has consumed them. The capacity of a tape is read once, as it is
+ * added, so the bookkeeping never touches a tape that another thread may be writing.
+ */
 template<typename Value>
-class Tape
+class TapeGroup
+{
+public:
+    void add(Tape<Value> * tape) {
+        tapes_.push_back(tape);
+        capacities_.push_back(tape->capacity());
+        ends_.push_back(0);
+    }
+
+    bool empty() const { return tapes_.empty(); }
+
+    std::size_t size() const { return tapes_.size(); }
+
+    std::size_t capacity() const {
+        std::size_t result = 0;
+        for (std::size_t cap : capacities_)
+            result = result + cap < result ? ~std::size_t(0) : result + cap;
+        return result;
+    }
+
+    void reset() { std::fill(ends_.begin(), ends_.end(), 0); }
+
+    std::size_t indexOf(Tape<Value> const * tape) const {
+        return std::find(tapes_.begin(), tapes_.end(), tape) - tapes_.begin();
+    }
+
+    // Has check() called before the first allocation, for a check of the room that only
+    // applies once something is written to the tapes.
+    void deferCheck(std::function<void()> check) { check_ = std::move(check); }
+
+    Run<Value> allocate(std::size_t size) {
+        runCheck();
+        for (std::size_t i = 0; i < tapes_.size(); ++i) {
+            std::size_t const idx = (next_ + i) % tapes_.size();
+            if (room(idx) >= size) {
+                next_ = idx + 1;
+                return take(idx, size);
+            }
+        }
+        return span(size);
+    }
+
+    // For runs of unknown length: all the room of the emptiest tape, give back the rest with
+    // shrink() once the run is complete.
+    Run<Value> allocateLargest() {
+        runCheck();
+        std::size_t best = 0;
+        for (std::size_t i = 1; i < tapes_.size(); ++i) {
+            if (room(i) > room(best))
+                best = i;
+        }
+        if (tapes_.empty() || room(best) == 0)
+            throw std::runtime_error("Insufficient temporary space: all tapes are full");
+        return take(best, room(best));
+    }
+
+    // For runs of unknown length that take size positions at most: all the room of the
+    // emptiest tape when that is enough, of all tapes otherwise. Give back the rest with
+    // shrink() once the run is complete.
+    Run<Value> allocateUpTo(std::size_t size) {
+        Run<Value> run = allocateLargest();
+        if (run.size >= size || tapes_.size() == 1)
+            return run;
+        shrink(run, 0);
+        return span(room());
+    }
+
+    // Gives back the end of the run allocated last on its tapes.
+    void shrink(Run<Value> & run, std::size_t size) {
+        if (run.span == nullptr) {
+            ends_[indexOf(run.tape)] -= run.size - size;
+            run.size = size;
+            return;
+        }
+        auto & segments = run.span->segments();
+        for (std::size_t excess = run.size - size; excess != 0;) {
+            auto & last = segments.back();
+            std::size_t const n = std::min(excess, last.size);
+            ends_[indexOf(last.tape)] -= n;
+            last.size -= n;
+            excess -= n;
+            if (last.size == 0)
+                segments.pop_back();
+        }
+        run.size = size;
+    }
+
+private:
+    void runCheck() {
+        if (!check_)
+            return;
+        auto check = std::move(check_);
+        check_ = nullptr;
+        check();
+    }
+
+    std::size_t room() const {
+        std::size_t result = 0;
+        for (std::size_t i = 0; i < tapes_.size(); ++i)
+            result += room(i);
+        return result;
+    }
+
+    std::size_t room(std::size_t idx) const {
+        return capacities_[idx] > ends_[idx] ? capacities_[idx] - ends_[idx] : 0;
+    }
+
+    Run<Value> take(std::size_t idx, std::size_t size) {
+        Run<Value> run{ tapes_[idx], ends_[idx], size, size };
+        ends_[idx] += size;
+        return run;
+    }
+
+    // Takes size positions from the ends of the tapes, those with the most room first.
+    Run<Value> span(std::size_t size) {
+        if (room() < size || size == 0)
+            throw std::runtime_error("Insufficient temporary space: the tapes have room for "
+                                     + std::to_string(room()) + " of " + std::to_string(size)
+                                     + " values");
+        std::vector<std::size_t> order(tapes_.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(),
+                  [this](std::size_t a, std::size_t b) { return room(a) > room(b); });
+        auto tape = std::make_shared<SegmentedTape<Value>>();
+        for (std::size_t i = 0, left = size; left != 0; ++i) {
+            std::size_t const n = std::min(room(order[i]), left);
+            tape->append(tapes_[order[i]], ends_[order[i]], n);
+            ends_[order[i]] += n;
+            left -= n;
+        }
+        Run<Value> run{ tape.get(), 0, size, size };
+        run.span = std::move(tape);
+        return run;
+    }
+
+    std::vector<Tape<Value> *> tapes_;
+    std::vector<std::size_t> capacities_;
+    std::vector<std::size_t> ends_;
+    std::size_t next_ = 0;
+    std::function<void()> check_;
+};
+
+/*
+ * Sequential reader of a run stored in [offset, offset + size) of a tape. Values are pulled
+ * with readBlock() into a private buffer, so the merge loop never calls into the tape per value.
+ * An encoded run (codecBlock != 0) is read into a buffer of encoded blocks and decoded one block
+ * at a time; the two buffers share blockSize. A reversed raw run is read block by block from its
+ * end, every block reversed in the buffer.
+ */
+template<typename Value>
+class RunReader
 {
 public:
     using value_type = Value;
-    virtual ~Tape() = default;
-    virtual std::size_t pos() const = 0;
-    virtual void pos(std::size_t idx) = 0;
-    virtual value_type read() const = 0;
-    virtual std::size_t size() const = 0;
-    virtual std::size_t capacity() const = 0;
-    virtual void write(value_type value) = 0;
-    virtual void flush() = 0;
+
+    RunReader(Tape<Value> * tape, std::size_t offset, std::size_t size, std::size_t blockSize,
+              std::size_t codecBlock = 0, MemoryBudget * budget = nullptr, bool reversed = false)
+        : tape_{ tape }
+        , next_{ reversed ? offset + size : offset }
+        , remaining_{ size }
+        , reversed_{ reversed }
+        , buffer_(BudgetAllocator<Value>{ budget })
+        , encoded_(BudgetAllocator<Value>{ budget }) {
+        if (codecBlock == 0) {
+            buffer_.resize(std::max<std::size_t>(1, std::min(blockSize, size)));
+        } else {
+            buffer_.resize(codecBlock);
+            encoded_.resize(bufferMemory<Value>(blockSize, codecBlock) - codecBlock);
+        }
+        fill();
+    }
+
+    bool empty() const { return cursor_ == buffered_; }
+
+    Value const & head() const { return buffer_[cursor_]; }
+
+    void next() {
+        if (++cursor_ == buffered_)
+            fill();
+    }
+
+private:
+    void fill() {
+        cursor_ = 0;
+        buffered_ = 0;
+        if constexpr (kRadixSortable<Value>) {
+            if (!encoded_.empty()) {
+                decodeBlock();
+                return;
+            }
+        }
+        if (remaining_ == 0)
+            return;
+        if (reversed_) {
+            std::size_t const n = std::min(buffer_.size(), remaining_);
+            next_ -= n;
+            tape_->pos(next_);
+            if (tape_->readBlock(buffer_.data(), n) != n)
+                throw std::runtime_error("Unexpected end of tape");
+            std::reverse(buffer_.begin(), buffer_.begin() + n);
+            buffered_ = n;
+            remaining_ -= n;
+            return;
+        }
+        tape_->pos(next_);
+        buffered_ = tape_->readBlock(buffer_.data(), std::min(buffer_.size(), remaining_));
+        if (buffered_ == 0)
+            throw std::runtime_error("Unexpected end of tape");
+        next_ += buffered_;
+        remaining_ -= buffered_;
+    }
+
+    void decodeBlock() {
+        if (encodedBegin_ == encodedEnd_ && remaining_ == 0)
+            return;
+        std::size_t count = 0;
+        std::size_t extent = 0;
+        load(DeltaCodec<Value>::kHeaderSlots);
+        DeltaCodec<Value>::header(encoded_.data() + encodedBegin_, count, extent);
+        if (count == 0 || count > buffer_.size() || extent > encoded_.size())
+            throw std::runtime_error("Corrupt run block");
+        load(extent);
+        DeltaCodec<Value>::decode(encoded_.data() + encodedBegin_, buffer_.data());
+        encodedBegin_ += extent;
+        buffered_ = count;
+    }
+
+    // Makes sure the encoded buffer holds at least n values past encodedBegin_.
+    void load(std::size_t n) {
+        if (encodedEnd_ - encodedBegin_ >= n)
+            return;
+        std::copy(encoded_.begin() + encodedBegin_, encoded_.begin() + encodedEnd_,
+                  encoded_.begin());
+        encodedEnd_ -= encodedBegin_;
+        encodedBegin_ = 0;
+        tape_->pos(next_);
+        std::size_t const got = tape_->readBlock(encoded_.data() + encodedEnd_,
+                                                 std::min(encoded_.size() - encodedEnd_,
+                                                          remaining_));
+        next_ += got;
+        remaining_ -= got;
+        encodedEnd_ += got;
+        if (encodedEnd_ < n)
+            throw std::runtime_error("Unexpected end of tape");
+    }
+
+    Tape<Value> * tape_;
+    std::size_t next_;
+    std::size_t remaining_;
+    bool reversed_;
+    Buffer<Value> buffer_;
+    std::size_t cursor_ = 0;
+    std::size_t buffered_ = 0;
+    Buffer<Value> encoded_;
+    std::size_t encodedBegin_ = 0;
+    std::size_t encodedEnd_ = 0;
 };
 
-namespace detail
+/*
+ * Sequential writer starting at offset of a tape. Values are collected into a block and handed
+ * to writeBlock() when the block is full or on finish(). With codecBlock != 0 every codecBlock
+ * values are encoded into a buffer of encoded blocks, which is written out once it can't take
+ * another one; the two buffers share blockSize.
+ */
+template<typename Value>
+class RunWriter
 {
+public:
+    RunWriter(Tape<Value> * tape, std::size_t offset, std::size_t blockSize,
+              std::size_t codecBlock = 0, MemoryBudget * budget = nullptr)
+        : tape_{ tape }
+        , start_{ offset }
+        , next_{ offset }
+        , blockSize_{ codecBlock == 0 ? std::max<std::size_t>(1, blockSize) : codecBlock }
+        , buffer_(BudgetAllocator<Value>{ budget })
+        , encoded_(BudgetAllocator<Value>{ budget }) {
+        buffer_.reserve(blockSize_);
+        if (codecBlock != 0)
+            encoded_.resize(bufferMemory<Value>(blockSize, codecBlock) - codecBlock);
+    }
 
-template<typename Value, std::size_t kMaxMemorySize, typename TapePtr = Tape<Value> *,
-         typename TapesContainer = std::vector<TapePtr>>
-void merge(size_t totalSize, TapesContainer && in, std::vector<std::size_t> const & sizes,
-           TapePtr & out) {
-    std::vector<std::size_t> cursors;
-    cursors.resize(in.size());
-    std::multiset<Value> data;
-    std::size_t writeCursor = 0;
-
-    constexpr std::size_t kCursorGuardValue = ~std::size_t(0);
-
-    auto getNextNonEmptyInputIndex = [&](std::size_t startIndex) -> std::size_t {
-        std::size_t currentIndex = startIndex;
-        while (currentIndex < in.size() && cursors[currentIndex] >= in[currentIndex]->size())
-            ++currentIndex;
-        if (currentIndex == in.size())
-            return kCursorGuardValue;
-        return currentIndex;
+    void push(Value value) {
+        buffer_.emplace_back(std::move(value));
+        if (buffer_.size() == blockSize_)
+            flushBlock();
+    }
+
+    void finish() {
+        flushBlock();
+        flushEncoded();
+        tape_->flush();
+    }
+
+    // Tape positions written so far, all of the run once finish() returned.
+    std::size_t extent() const { return next_ - start_; }
+
+private:
+    void flushBlock() {
+        if (buffer_.empty())
+            return;
+        if constexpr (kRadixSortable<Value>) {
+            if (!encoded_.empty()) {
+                if (encoded_.size() - encodedEnd_ < DeltaCodec<Value>::blockBound(buffer_.size()))
+                    flushEncoded();
+                encodedEnd_ += DeltaCodec<Value>::encode(buffer_.data(), buffer_.size(),
+                                                         encoded_.data() + encodedEnd_);
+                buffer_.clear();
+                return;
+            }
+        }
+        tape_->pos(next_);
+        tape_->writeBlock(buffer_.data(), buffer_.size());
+        next_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    void flushEncoded() {
+        if (encodedEnd_ == 0)
+            return;
+        tape_->pos(next_);
+        tape_->writeBlock(encoded_.data(), encodedEnd_);
+        next_ += encodedEnd_;
+        encodedEnd_ = 0;
+    }
+
+    Tape<Value> * tape_;
+    std::size_t start_;
+    std::size_t next_;
+    std::size_t blockSize_;
+    Buffer<Value> buffer_;
+    Buffer<Value> encoded_;
+    std::size_t encodedEnd_ = 0;
+};
+
+template<typename Reader, typename Writer, typename Combine>
+std::size_t mergeLinearScan(std::vector<Reader> & readers, Writer & writer, std::size_t limit,
+                            Combine & combine, std::uint64_t & comparisons) {
+    constexpr std::size_t kNoInput = ~std::size_t(0);
+    auto const smallest = [&readers, &comparisons] {
+        std::size_t minIdx = kNoInput;
+        for (std::size_t i = 0; i < readers.size(); ++i) {
+            if (readers[i].empty())
+                continue;
+            if (minIdx != kNoInput)
+                ++comparisons;
+            if (minIdx == kNoInput || readers[i].head() < readers[minIdx].head())
+                minIdx = i;
+        }
+        return minIdx;
     };
 
-    auto findMinimalValue = [&]() -> std::pair<std::size_t, std::optional<Value>> {
-        auto nextNonEmptyIndex = getNextNonEmptyInputIndex(0);
+    std::size_t written = 0;
+    while (written < limit) {
+        std::size_t minIdx = smallest();
+        if (minIdx == kNoInput)
+            break;
+        if constexpr (kCombines<Combine>) {
+            typename Reader::value_type value = readers[minIdx].head();
+            readers[minIdx].next();
+            while ((minIdx = smallest()) != kNoInput && !(value < readers[minIdx].head())) {
+                ++comparisons;
+                combine(value, readers[minIdx].head());
+                readers[minIdx].next();
+            }
+            writer.push(std::move(value));
+        } else {
+            writer.push(readers[minIdx].head());
+            readers[minIdx].next();
+        }
+        ++written;
+    }
+    return written;
+}
 
-        if (nextNonEmptyIndex == kCursorGuardValue)
-            return std::make_pair(kCursorGuardValue, std::nullopt);
+template<typename Reader, typename Writer, typename Combine>
+std::size_t mergeLoserTree(std::vector<Reader> & readers, Writer & writer, std::size_t limit,
+                           Combine & combine, std::uint64_t & comparisons) {
+    LoserTree<typename Reader::value_type> tree{ readers.size() };
+    for (std::size_t i = 0; i < readers.size(); ++i) {
+        if (!readers[i].empty())
+            tree.set(i, readers[i].head());
+    }
+    tree.build();
 
-        std::size_t minIdx = nextNonEmptyIndex;
-        in[minIdx]->pos(cursors[minIdx]);
-        Value minValue = in[minIdx]->read();
+    auto const advance = [&readers, &tree] {
+        auto & reader = readers[tree.top()];
+        reader.next();
+        if (reader.empty())
+            tree.popTop();
+        else
+            tree.replaceTop(reader.head());
+    };
 
-        while (nextNonEmptyIndex != kCursorGuardValue) {
-            nextNonEmptyIndex = getNextNonEmptyInputIndex(nextNonEmptyIndex + 1);
-            if (nextNonEmptyIndex == kCursorGuardValue)
-                break;
-            in[nextNonEmptyIndex]->pos(cursors[nextNonEmptyIndex]);
-            Value nextValue = in[nextNonEmptyIndex]->read();
-            if (nextValue < minValue) {
-                minValue = nextValue;
-                minIdx = nextNonEmptyIndex;
+    std::size_t written = 0;
+    while (written < limit && !tree.empty()) {
+        if constexpr (kCombines<Combine>) {
+            typename Reader::value_type value = tree.topValue();
+            advance();
+            while (!tree.empty() && !(value < tree.topValue())) {
+                ++comparisons;
+                combine(value, tree.topValue());
+                advance();
             }
+            writer.push(std::move(value));
+        } else {
+            writer.push(tree.topValue());
+            advance();
         }
-        return std::make_pair(minIdx, std::move(minValue));
+        ++written;
+    }
+    comparisons += tree.comparisons();
+    return written;
+}
+
+// Merges the readers into writer, stopping after limit values, and returns how many it wrote.
+// With a combiner every group of equivalent values is written as a single one.
+template<typename Reader, typename Writer, typename Combine = NoCombine>
+std::size_t mergeWith(std::vector<Reader> & readers, Writer & writer, MergeStrategy strategy,
+                      std::size_t limit = kUnlimited, Combine combine = Combine{},
+                      SortMonitor * monitor = nullptr) {
+    std::size_t written = 0;
+    std::uint64_t comparisons = 0;
+    switch (strategy) {
+    case MergeStrategy::LinearScan:
+        written = mergeLinearScan(readers, writer, limit, combine, comparisons);
+        break;
+    case MergeStrategy::LoserTree:
+        written = mergeLoserTree(readers, writer, limit, combine, comparisons);
+        break;
+    }
+    writer.finish();
+    if (monitor != nullptr)
+        monitor->compared(comparisons);
+    return written;
+}
+
+// Value at idx of a run of raw values.
+template<typename Value>
+Value runValue(Run<Value> const & run, std::size_t idx) {
+    Value value;
+    run.tape->pos(runOffset(run, idx, 1));
+    if (run.tape->readBlock(&value, 1) != 1)
+        throw std::runtime_error("Unexpected end of tape");
+    return value;
+}
+
+// Values of a run of raw values less than value, or not greater than it with upper.
+template<typename Value>
+std::size_t runRank(Run<Value> const & run, Value const & value, bool upper) {
+    std::size_t first = 0;
+    std::size_t count = run.count;
+    while (count != 0) {
+        std::size_t const step = count / 2;
+        Value const probe = runValue(run, first + step);
+        if (upper ? !(value < probe) : probe < value) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    return first;
+}
+
+/*
+ * Final merge of raw runs split into key ranges merged in parallel. Splitters are picked from
+ * a regular sample of every run, then every run is cut at each splitter by binary search. The
+ * values equal to a splitter are shared out between the two ranges to bring the range as close
+ * as possible to its share of the output, which keeps the ranges balanced on duplicates too.
+ * Range j of every run, and so the offset of range j in the output, are known up front: every
+ * worker merges its range into its own region of the output. Tapes are shared through
+ * SharedTape handles, one mutex per tape.
+ */
+template<typename Value>
+std::size_t mergeParallel(std::vector<Run<Value>> const & runs, Run<Value> const & target,
+                          std::size_t partitions, std::size_t memoryValues,
+                          SortOptions const & options, MemoryBudget & budget,
+                          SortMonitor * monitor) {
+    constexpr std::size_t kOversampling = 16;
+    std::size_t const k = runs.size();
+    std::size_t const total = target.count;
+
+    std::vector<std::vector<std::size_t>> cuts(partitions + 1, std::vector<std::size_t>(k, 0));
+    for (std::size_t i = 0; i < k; ++i)
+        cuts[partitions][i] = runs[i].count;
+    {
+        auto const samplesOf = [&](Run<Value> const & run) {
+            return std::min({ run.count, partitions * kOversampling, memoryValues / k });
+        };
+        std::size_t samples = 0;
+        for (auto const & run : runs)
+            samples += samplesOf(run);
+        Buffer<Value> sample{ BudgetAllocator<Value>{ &budget } };
+        sample.reserve(samples);
+        for (auto const & run : runs) {
+            std::size_t const n = samplesOf(run);
+            for (std::size_t t = 0; t < n; ++t)
+                sample.push_back(runValue(run, t * run.count / n));
+        }
+        std::sort(sample.begin(), sample.end());
+
+        std::vector<std::size_t> lower(k);
+        std::vector<std::size_t> upper(k);
+        for (std::size_t j = 1; j < partitions; ++j) {
+            Value const & splitter = sample[j * sample.size() / partitions];
+            std::size_t below = 0;
+            std::size_t notAbove = 0;
+            for (std::size_t i = 0; i < k; ++i) {
+                lower[i] = runRank(runs[i], splitter, false);
+                upper[i] = runRank(runs[i], splitter, true);
+                below += lower[i];
+                notAbove += upper[i];
+            }
+            std::size_t const wanted = std::min(std::max(j * total / partitions, below), notAbove);
+            std::size_t equal = wanted - below;
+            for (std::size_t i = 0; i < k; ++i) {
+                std::size_t const take = std::min(upper[i] - lower[i], equal);
+                cuts[j][i] = std::max(lower[i] + take, cuts[j - 1][i]);
+                equal -= take;
+            }
+        }
+    }
+
+    std::vector<Tape<Value> *> tapes{ target.tape };
+    for (auto const & run : runs) {
+        if (std::find(tapes.begin(), tapes.end(), run.tape) == tapes.end())
+            tapes.push_back(run.tape);
+    }
+    std::vector<std::mutex> mutexes(tapes.size());
+    auto mutexOf = [&](Tape<Value> * tape) {
+        return &mutexes[std::find(tapes.begin(), tapes.end(), tape) - tapes.begin()];
     };
 
-    using multiset = std::multiset<Value>;
-    using node_type = typename multiset::node_type;
-    std::optional<node_type> node;
-    constexpr std::size_t kMaxMultisetSize = kMaxMemorySize / sizeof(node_type);
-    for (;;) {
-        auto min = findMinimalValue();
-        while (min.first != kCursorGuardValue && data.size() < kMaxMultisetSize) {
-            ++cursors[min.first];
-            if (node) {
-                node->value() = *min.second;
-                data.insert(std::move(*node));
-                node.reset();
-            } else {
-                data.insert(*min.second);
+    // Every range gets its share of the memory, split like in a sequential merge.
+    std::size_t const blockSize = memoryValues / (partitions * (k + 1));
+    auto mergeRange = [&](std::size_t j) {
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < k; ++i)
+            offset += cuts[j][i];
+        std::vector<SharedTape<Value>> handles;
+        handles.reserve(k + 1);
+        std::vector<RunReader<Value>> readers;
+        readers.reserve(k);
+        for (std::size_t i = 0; i < k; ++i) {
+            std::size_t const size = cuts[j + 1][i] - cuts[j][i];
+            if (size == 0)
+                continue;
+            handles.emplace_back(runs[i].tape, mutexOf(runs[i].tape));
+            readers.emplace_back(&handles.back(), runOffset(runs[i], cuts[j][i], size), size,
+                                 blockSize, 0, &budget, runs[i].reversed);
+        }
+        handles.emplace_back(target.tape, mutexOf(target.tape));
+        RunWriter<Value> writer{ &handles.back(), target.offset + offset, blockSize, 0, &budget };
+        return mergeWith(readers, writer, options.mergeStrategy, kUnlimited, NoCombine{},
+                         monitor);
+    };
+
+    std::size_t written = 0;
+    {
+        ThreadPool pool{ partitions - 1 };
+        std::vector<std::future<std::size_t>> pending;
+        for (std::size_t j = 1; j < partitions; ++j)
+            pending.push_back(pool.submit([&mergeRange, j] { return mergeRange(j); }));
+        written = mergeRange(0);
+        for (auto & result : pending)
+            written += result.get();
+    }
+    if (written != total)
+        throw std::runtime_error("Merged " + std::to_string(written) + " values instead of "
+                                 + std::to_string(total));
+    return written;
+}
+
+/*
+ * Merges the first target.count values of runs into target and returns the tape positions it
+ * took. The target is encoded like the runs, unless it is the last merge, which writes the raw
+ * output, in parallel with threads unless it uses async I/O or a run is spanned. A combiner
+ * leaves fewer values, target.count is set to how many; the key ranges of a parallel merge
+ * would each combine on their own, so it runs on the calling thread then.
+ */
+template<typename Value, typename Combine = NoCombine>
+std::size_t merge(std::vector<Run<Value>> const & runs, Run<Value> & target, bool last,
+                  std::size_t memoryValues, SortOptions const & options, MemoryBudget & budget,
+                  Combine combine = Combine{}, SortMonitor * monitor = nullptr) {
+    std::size_t const codec = codecBlock<Value>(memoryValues, options);
+    bool const async = options.asyncIo && codec == 0;
+    // Without spare tapes all runs are merged at once, which may not leave every one of them
+    // the smallest buffer it needs.
+    std::size_t const share = memoryValues / (runs.size() + 1);
+    if (share < (codec != 0 ? bufferMemory<Value>(0, codec) : async ? 2 : 1))
+        throw std::runtime_error("Insufficient memory to merge " + std::to_string(runs.size())
+                                 + " runs at once");
+
+    // The workers share tapes through a mutex per tape, which doesn't cover the tapes under a
+    // spanned run.
+    bool const spanned = std::any_of(runs.begin(), runs.end(),
+                                     [](Run<Value> const & run) { return run.span != nullptr; });
+    if (last && codec == 0 && options.threads != 0 && !options.asyncIo && !kCombines<Combine>
+        && !spanned) {
+        std::size_t const partitions =
+            std::min({ options.threads + 1, share, std::max<std::size_t>(target.count, 1) });
+        if (partitions > 1)
+            return mergeParallel(runs, target, partitions, memoryValues, options, budget,
+                                 monitor);
+    }
+
+    std::size_t written = 0;
+    std::size_t extent = 0;
+    if (async) {
+        // Two buffers per run and two for the output.
+        std::size_t const blockSize = memoryValues / (2 * (runs.size() + 1));
+        AsyncIo<Value> io;
+        std::vector<AsyncRunReader<Value>> readers;
+        readers.reserve(runs.size());
+        for (auto const & run : runs) {
+            if (run.size != 0)
+                readers.emplace_back(io, run.tape, run.offset, run.size, blockSize, &budget,
+                                     run.reversed);
+        }
+        AsyncRunWriter<Value> writer{ io, target.tape, target.offset, blockSize, &budget };
+        written = mergeWith(readers, writer, options.mergeStrategy, target.count, combine,
+                            monitor);
+        extent = written;
+    } else {
+        // The memory budget is shared evenly between one read buffer per run and the output
+        // buffer.
+        std::size_t const blockSize = memoryValues / (runs.size() + 1);
+        std::vector<RunReader<Value>> readers;
+        readers.reserve(runs.size());
+        for (auto const & run : runs) {
+            if (run.size != 0)
+                readers.emplace_back(run.tape, run.offset, run.size, blockSize,
+                                     run.natural ? 0 : codec, &budget, run.reversed);
+        }
+        RunWriter<Value> writer{ target.tape, target.offset, blockSize, last ? 0 : codec,
+                                 &budget };
+        written = mergeWith(readers, writer, options.mergeStrategy, target.count, combine,
+                            monitor);
+        extent = writer.extent();
+    }
+    if (kCombines<Combine> && written <= target.count)
+        target.count = written;
+    if (written != target.count)
+        throw std::runtime_error("Merged " + std::to_string(written) + " values instead of "
+                                 + std::to_string(target.count));
+    return extent;
+}
+
+/*
+ * Balanced multi-pass merge. While there are more runs than fanIn, every pass merges groups of
+ * at most fanIn runs from source into target and the two groups swap roles. Runs are spread so
+ * that the groups add up to about as many values each. Runs on neither group, natural runs of
+ * the input, can wait for a later pass, so up to fanIn - 1 of those that are at least as large
+ * as what the pass makes of the others are left as they are. The pass before the last one
+ * merges only as many of the smallest runs as needed to get down to fanIn runs, the rest join
+ * the final merge from where they are. Returns the runs left for the final merge,
+ * which is up to the caller. Every merged run of count values is allocated with
+ * allocate(tapes, count) and shrunk to the positions merge(runs, target) returns it took;
+ * merge() may lower target.count. Every pass is a phase of the monitor, if there is one.
+ */
+template<typename Value, typename AllocateFn, typename MergeFn>
+std::vector<Run<Value>> mergePasses(std::vector<Run<Value>> runs, TapeGroup<Value> & source,
+                                    TapeGroup<Value> & target, std::size_t fanIn,
+                                    AllocateFn && allocate, MergeFn && merge,
+                                    SortMonitor * monitor = nullptr) {
+    TapeGroup<Value> * to = &target;
+    TapeGroup<Value> * from = &source;
+
+    std::vector<Run<Value>> merged;
+    auto mergeGroup = [&](std::vector<Run<Value>> const & group) {
+        std::size_t count = 0;
+        for (auto const & run : group)
+            count += run.count;
+        Run<Value> run = allocate(*to, count);
+        std::size_t const extent = merge(group, run);
+        to->shrink(run, extent);
+        merged.push_back(run);
+    };
+
+    // Without spare tapes there is no room for intermediate runs, all of them are merged at once.
+    for (std::size_t pass = 1; runs.size() > fanIn && !to->empty(); ++pass) {
+        to->reset();
+        merged.clear();
+        std::vector<std::vector<Run<Value>>> groups;
+        if ((runs.size() + fanIn - 1) / fanIn <= fanIn) {
+            std::sort(runs.begin(), runs.end(),
+                      [](Run<Value> const & a, Run<Value> const & b) { return a.count < b.count; });
+            std::size_t excess = runs.size() - fanIn;
+            std::size_t first = 0;
+            while (excess != 0) {
+                std::size_t const count = std::min(fanIn, excess + 1);
+                groups.emplace_back(runs.begin() + first, runs.begin() + first + count);
+                first += count;
+                excess -= count - 1;
             }
-            min = findMinimalValue();
+            merged.insert(merged.end(), runs.begin() + first, runs.end());
+        } else {
+            std::sort(runs.begin(), runs.end(),
+                      [](Run<Value> const & a, Run<Value> const & b) { return a.count > b.count; });
+            std::size_t total = 0;
+            for (auto const & run : runs)
+                total += run.count;
+            std::size_t const average = total / ((runs.size() + fanIn - 1) / fanIn);
+            std::vector<Run<Value>> rest;
+            for (auto const & run : runs) {
+                if (run.natural && run.count >= average && merged.size() + 1 < fanIn)
+                    merged.push_back(run);
+                else
+                    rest.push_back(run);
+            }
+
+            // Largest first, every run goes to the group with the fewest values that has room.
+            std::size_t const groupCount = (rest.size() + fanIn - 1) / fanIn;
+            std::vector<std::vector<Run<Value>>> members(groupCount);
+            std::vector<std::pair<std::size_t, std::size_t>> lightest;
+            for (std::size_t g = 0; g < groupCount; ++g)
+                lightest.emplace_back(0, g);
+            auto const heavier = [](auto const & a, auto const & b) { return a > b; };
+            for (auto const & run : rest) {
+                std::pop_heap(lightest.begin(), lightest.end(), heavier);
+                auto & group = lightest.back();
+                members[group.second].push_back(run);
+                group.first += run.count;
+                if (members[group.second].size() == fanIn)
+                    lightest.pop_back();
+                else
+                    std::push_heap(lightest.begin(), lightest.end(), heavier);
+            }
+            groups = std::move(members);
         }
-        node = data.extract(data.begin());
-        out->pos(writeCursor);
-        out->write(node->value());
-        ++writeCursor;
-        if (writeCursor == totalSize)
-            break;
+
+        if (monitor != nullptr) {
+            std::size_t total = 0;
+            for (auto const & group : groups) {
+                for (auto const & run : group)
+                    total += run.count;
+            }
+            monitor->beginPhase("merge pass " + std::to_string(pass), total, true);
+        }
+        for (auto const & group : groups)
+            mergeGroup(group);
+        if (monitor != nullptr)
+            monitor->endPhase(merged.size());
+        runs.swap(merged);
+        std::swap(from, to);
     }
-    out->flush();
+    return runs;
 }
 
-}  // namespace detail
+/*
+ * Runs are formed on the first group of tapes. When they can't all be merged at once, every
+ * other tape is set aside for the merge passes, which then ping-pong between the groups. Runs
+ * that don't fit on one tape are spanned over several, so every group that takes runs only
+ * needs runsSize positions in total, and this is checked before any I/O. With deferCheck it is
+ * checked before the first run is allocated instead, for inputs that may turn out to need no
+ * temporary space at all; the groups must live until then.
+ */
+template<typename Value, typename TapesContainer>
+void splitTapes(TapesContainer & tmp, bool multiPass, std::size_t runsSize, bool deferCheck,
+                TapeGroup<Value> & first, TapeGroup<Value> & second) {
+    multiPass = multiPass && tmp.size() > 1;
+    for (std::size_t i = 0; i < tmp.size(); ++i) {
+        if (multiPass && i % 2 == 1)
+            second.add(rawTape(tmp[i]));
+        else
+            first.add(rawTape(tmp[i]));
+    }
 
-template<typename Value, std::size_t kMaxMemorySize, typename TapePtr = Tape<Value> *,
-         typename TapesContainer = std::vector<TapePtr>>
-void externalSort(TapePtr && in, TapePtr && out, TapesContainer & tmp) {
-    std::size_t const inputSize = in->size();
-    std::size_t const chunkCount = (sizeof(Value) * inputSize + kMaxMemorySize - 1) / kMaxMemorySize;
-    std::size_t const chunkSize = inputSize / chunkCount;
+    auto check = [&first, &second, multiPass, runsSize] {
+        for (auto * group : { &first, &second }) {
+            if (group->capacity() < runsSize && (group == &first || multiPass))
+                throw std::runtime_error("Insufficient temporary space: "
+                                         + std::to_string(group->capacity()) + " < "
+                                         + std::to_string(runsSize));
+        }
+    };
+    if (deferCheck)
+        first.deferCheck(check);
+    else
+        check();
+}
 
-    if (chunkSize > kMaxMemorySize)
-        throw std::runtime_error("Insufficient memory");
+/*
+ * The largest fan-in that still gives every run and the output a buffer of at least
+ * minBlockBytes, capped by maxFanIn and never below 2. Encoded runs need room for a decoded
+ * block and an encoded one.
+ */
+template<typename Value>
+std::size_t fanIn(std::size_t memoryValues, SortOptions const & options) {
+    std::size_t const codec = codecBlock<Value>(memoryValues, options);
+    std::size_t const minBlock =
+        codec == 0 ? std::max<std::size_t>(1, options.minBlockBytes / sizeof(Value))
+                   : bufferMemory<Value>(0, codec);
+    std::size_t const buffers = memoryValues / minBlock;
+    std::size_t result = buffers > 1 ? buffers - 1 : 0;
+    if (options.maxFanIn != 0)
+        result = std::min(result, options.maxFanIn);
+    return std::max<std::size_t>(result, 2);
+}
 
-    std::size_t const tmpCapacity = [&tmp, chunkSize]() {
-        std::size_t result = 0;
-        for (auto & tmpPtr : tmp) {
-            std::size_t cap = tmpPtr->capacity();
-            if (cap < chunkSize)
-                throw std::runtime_error("One of temporary tapes too small: " + std::to_string(cap)
-                                         + " < " + std::to_string(chunkSize));
-            result += cap;
+/*
+ * Allocates a run of count values. A raw run takes exactly count positions. How many an encoded
+ * run takes is only known once it is written, so it gets all the room of the emptiest tape, or
+ * of all of them when that may be too little, and has to be shrunk before anything else is
+ * allocated.
+ */
+template<typename Value>
+Run<Value> allocateRun(TapeGroup<Value> & tapes, std::size_t count, std::size_t codecBlock) {
+    Run<Value> run = codecBlock == 0 ? tapes.allocate(count)
+                                     : tapes.allocateUpTo(runExtent<Value>(count, codecBlock));
+    run.count = count;
+    return run;
+}
+
+/*
+ * Natural runs of the input, found a chunk at a time. A chunk that is already sorted, or
+ * strictly decreasing, needs neither sorting nor storing: it is read in place from the input by
+ * the merges, and so are stretches of such chunks that go on in the same direction. As long as
+ * the input is one ascending run, the chunks are also copied to out, if there is one, so a
+ * sorted input is done once it has been read.
+ */
+template<typename Value>
+class NaturalRuns
+{
+public:
+    NaturalRuns(SortOptions const & options, Tape<Value> * in, Tape<Value> * out)
+        : enabled_{ options.naturalRuns && options.runGeneration == RunGeneration::Chunks }
+        , in_{ in }
+        , out_{ out } {}
+
+    // Takes the chunk read from offset of the input when it is a natural run, the caller sorts
+    // and stores it otherwise.
+    bool add(Value const * chunk, std::size_t count, std::size_t offset) {
+        if (!enabled_ || count == 0)
+            return false;
+        bool const ascending = std::is_sorted(chunk, chunk + count);
+        bool const descending =
+            !ascending
+            && std::adjacent_find(chunk, chunk + count, [](Value const & a, Value const & b) {
+                   return !(b < a);
+               }) == chunk + count;
+        bool const continues = open_ && last_
+                               && (ascending ? !reversed_ && !(chunk[0] < *last_)
+                                             : reversed_ && chunk[0] < *last_);
+        if (!ascending && !descending) {
+            close();
+            copying_ = false;
+            return false;
         }
-        return result;
-    }();
+        if (!continues) {
+            close();
+            open_ = true;
+            reversed_ = descending;
+            start_ = offset;
+            size_ = 0;
+        }
+        size_ += count;
+        last_ = chunk[count - 1];
+        copying_ = copying_ && out_ != nullptr && start_ == 0 && !reversed_;
+        if (copying_) {
+            out_->pos(offset);
+            out_->writeBlock(chunk, count);
+        }
+        return true;
+    }
+
+    // Adds the natural runs, each cut to its first limit values, to runs.
+    void finish(std::size_t limit, std::vector<Run<Value>> & runs) {
+        close();
+        for (auto run : runs_) {
+            run.count = std::min(run.count, limit);
+            run.offset = runOffset(run, 0, run.count);
+            run.size = run.count;
+            runs.push_back(run);
+        }
+        if (copying_ && out_ != nullptr)
+            out_->flush();
+    }
+
+    bool enabled() const { return enabled_; }
+
+    // Values of the input copied to out, which hold the whole output if that is all of it.
+    std::size_t copied() const {
+        return copying_ && runs_.size() == 1 ? runs_.front().count : 0;
+    }
+
+private:
+    void close() {
+        if (open_)
+            runs_.push_back(Run<Value>{ in_, start_, size_, size_, true, reversed_ });
+        open_ = false;
+    }
+
+    bool enabled_;
+    Tape<Value> * in_;
+    Tape<Value> * out_;
+    std::vector<Run<Value>> runs_;
+    bool open_ = false;
+    bool reversed_ = false;
+    bool copying_ = true;
+    std::size_t start_ = 0;
+    std::size_t size_ = 0;
+    std::optional<Value> last_;
+};
 
-    if (tmpCapacity < inputSize)
-        throw std::runtime_error("Insufficient temporary space: " + std::to_string(tmpCapacity)
-                                 + " < " + std::to_string(inputSize));
-    std::vector<std::size_t> chunkSizes;
-    chunkSizes.resize(tmp.size());
+// Writes a sorted chunk as a new run.
+template<typename Value>
+Run<Value> storeRun(TapeGroup<Value> & tapes, Value const * data, std::size_t count,
+                    std::size_t codecBlock, MemoryBudget & budget) {
+    Run<Value> run = allocateRun(tapes, count, codecBlock);
+    if (codecBlock == 0) {
+        run.tape->pos(run.offset);
+        run.tape->writeBlock(data, count);
+        run.tape->flush();
+        return run;
+    }
+    RunWriter<Value> writer{ run.tape, run.offset, 0, codecBlock, &budget };
+    for (std::size_t i = 0; i < count; ++i)
+        writer.push(data[i]);
+    writer.finish();
+    tapes.shrink(run, writer.extent());
+    return run;
+}
+
+// Sorts memory sized chunks into runs, keeping the first limit values of every combined chunk.
+template<typename Value, typename Combine>
+void formRuns(Tape<Value> * in, TapeGroup<Value> & tapes, std::size_t chunkSize,
+              std::size_t codecBlock, std::size_t limit, Combine combine,
+              NaturalRuns<Value> & natural, MemoryBudget & budget,
+              std::vector<Run<Value>> & runs) {
+    std::size_t const inputSize = in->size();
     std::size_t totalRead = 0;
-    std::size_t tmpIndex = 0;
 
+    Buffer<Value> chunk{ BudgetAllocator<Value>{ &budget } };
     while (totalRead < inputSize) {
-        std::vector<Value> chunk;
-        chunk.reserve(chunkSize);
-        std::size_t cursor = 0;
-        while (cursor < chunkSize && totalRead + cursor < inputSize) {
-            in->pos(totalRead + cursor);
-            chunk.emplace_back(in->read());
-            ++cursor;
-        }
-        std::sort(chunk.begin(), chunk.end());
-        chunkSizes[tmpIndex] = chunk.size();
-        totalRead += cursor;
-        cursor = 0;
-        while (cursor < chunk.size()) {
-            tmp[tmpIndex]->pos(cursor);
-            tmp[tmpIndex]->write(chunk[cursor]);
-            ++cursor;
-        }
-        tmp[tmpIndex]->flush();
-        ++tmpIndex;
-    }
-    detail::merge<Value, kMaxMemorySize>(inputSize, tmp, chunkSizes, out);
+        chunk.resize(std::min(chunkSize, inputSize - totalRead));
+        in->pos(totalRead);
+        if (in->readBlock(chunk.data(), chunk.size()) != chunk.size())
+            throw std::runtime_error("Unexpected end of input tape");
+        std::size_t const offset = totalRead;
+        totalRead += chunk.size();
+        if (natural.add(chunk.data(), chunk.size(), offset))
+            continue;
+        sortChunk(chunk.data(), chunk.data() + chunk.size());
+        std::size_t const count =
+            combineSorted(chunk.data(), chunk.data() + chunk.size(), combine) - chunk.data();
+        runs.push_back(storeRun(tapes, chunk.data(), std::min(count, limit), codecBlock, budget));
+    }
+}
+
+/*
+ * Pipelined run formation: the calling thread reads chunks while the pool sorts the previous
+ * ones and writes them to their temporary tapes. There are exactly threads + 1 chunk buffers,
+ * each one of chunkSize values, and the reader blocks until one of them is released, so the
+ * memory in use never exceeds that. Raw runs are allocated up front and written concurrently
+ * unless they share a tape; a combiner may leave the end of their room unused. The size of an
+ * encoded run is only known once it is written, so encoded runs are allocated and written one
+ * at a time.
+ */
+template<typename Value, typename Combine>
+void formRunsPipelined(Tape<Value> * in, TapeGroup<Value> & tapes, std::size_t chunkSize,
+                       std::size_t threads, std::size_t codecBlock, std::size_t limit,
+                       Combine combine, NaturalRuns<Value> & natural, MemoryBudget & budget,
+                       std::vector<Run<Value>> & runs) {
+    std::size_t const inputSize = in->size();
+    std::vector<Buffer<Value>> buffers(threads + 1,
+                                       Buffer<Value>{ BudgetAllocator<Value>{ &budget } });
+    // Runs sharing a tape may be written concurrently.
+    std::vector<std::mutex> tapeMutexes(tapes.size());
+    std::mutex storeMutex;
+    std::vector<std::size_t> freeBuffers;
+    for (std::size_t i = 0; i < buffers.size(); ++i)
+        freeBuffers.push_back(i);
+    std::mutex mutex;
+    std::condition_variable released;
+
+    auto release = [&](std::size_t buffer) {
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            freeBuffers.push_back(buffer);
+        }
+        released.notify_one();
+    };
+
+    // Values kept of every chunk, in input order.
+    std::vector<std::future<std::size_t>> pending;
+    {
+        ThreadPool pool{ threads };
+        std::size_t totalRead = 0;
+        while (totalRead < inputSize) {
+            std::size_t buffer;
+            {
+                std::unique_lock<std::mutex> lock{ mutex };
+                released.wait(lock, [&freeBuffers] { return !freeBuffers.empty(); });
+                buffer = freeBuffers.back();
+                freeBuffers.pop_back();
+            }
+            auto & chunk = buffers[buffer];
+            chunk.resize(std::min(chunkSize, inputSize - totalRead));
+            in->pos(totalRead);
+            if (in->readBlock(chunk.data(), chunk.size()) != chunk.size())
+                throw std::runtime_error("Unexpected end of input tape");
+            std::size_t const offset = totalRead;
+            totalRead += chunk.size();
+            if (natural.add(chunk.data(), chunk.size(), offset)) {
+                release(buffer);
+                continue;
+            }
+            std::size_t const kept = std::min(chunk.size(), limit);
+
+            // A spanned run may share any of the tapes, it is written holding all of them.
+            Run<Value> run{};
+            std::mutex * tapeMutex = &storeMutex;
+            if (codecBlock == 0) {
+                runs.push_back(tapes.allocate(kept));
+                run = runs.back();
+                tapeMutex = run.span != nullptr ? nullptr : &tapeMutexes[tapes.indexOf(run.tape)];
+            }
+            pending.push_back(pool.submit([&, run, tapeMutex, buffer, kept, combine]() mutable {
+                std::size_t count = 0;
+                try {
+                    sortChunk(chunk.data(), chunk.data() + chunk.size());
+                    count = std::min<std::size_t>(
+                        combineSorted(chunk.data(), chunk.data() + chunk.size(), combine)
+                            - chunk.data(),
+                        kept);
+                    std::vector<std::unique_lock<std::mutex>> locks;
+                    if (tapeMutex != nullptr) {
+                        locks.emplace_back(*tapeMutex);
+                    } else {
+                        for (auto & tapeMutex : tapeMutexes)
+                            locks.emplace_back(tapeMutex);
+                    }
+                    if (codecBlock == 0) {
+                        run.tape->pos(run.offset);
+                        run.tape->writeBlock(chunk.data(), count);
+                        run.tape->flush();
+                    } else {
+                        runs.push_back(storeRun(tapes, chunk.data(), count, codecBlock, budget));
+                    }
+                } catch (...) {
+                    release(buffer);
+                    throw;
+                }
+                release(buffer);
+                return count;
+            }));
+        }
+    }
+    for (std::size_t i = 0; i < pending.size(); ++i) {
+        std::size_t const count = pending[i].get();
+        if (codecBlock == 0)
+            runs[i].size = runs[i].count = count;
+    }
+}
+
+/*
+ * Replacement selection: a min-heap of heapSize values emits its minimum to the current run and
+ * takes the next input value in its place. A value smaller than the last one emitted can't join
+ * the current run, so it is parked behind the heap for the next one; the run ends when the heap
+ * is drained. Random input yields runs of 2 * heapSize on average, presorted input much longer
+ * ones. Every run goes to the tape with the most room and is cut when that tape is full, which
+ * keeps the output correct, just with a shorter run. Values of a run past the first limit are
+ * dropped instead of written. A combiner holds the last value of the run back until a greater
+ * one comes and folds the equivalent ones into it.
+ */
+template<typename Value, typename Combine>
+void formRunsReplacementSelection(Tape<Value> * in, TapeGroup<Value> & tapes,
+                                  std::size_t heapSize, std::size_t blockSize,
+                                  std::size_t codecBlock, std::size_t limit, Combine combine,
+                                  MemoryBudget & budget, std::vector<Run<Value>> & runs) {
+    auto const greater = [](Value const & a, Value const & b) { return b < a; };
+
+    RunReader<Value> reader{ in, 0, in->size(), blockSize, 0, &budget };
+    // [0, heapEnd) is the heap of the current run, [heapEnd, heap.size()) waits for the next one.
+    Buffer<Value> heap{ BudgetAllocator<Value>{ &budget } };
+    heap.reserve(heapSize);
+    while (heap.size() < heapSize && !reader.empty()) {
+        heap.push_back(reader.head());
+        reader.next();
+    }
+    std::make_heap(heap.begin(), heap.end(), greater);
+    std::size_t heapEnd = heap.size();
+
+    while (!heap.empty()) {
+        Run<Value> run = tapes.allocateLargest();
+        if (runExtent<Value>(1, codecBlock) > run.size)
+            throw std::runtime_error("Insufficient temporary space: all tapes are full");
+        RunWriter<Value> writer{ run.tape, run.offset, blockSize, codecBlock, &budget };
+        std::size_t runSize = 0;
+        std::optional<Value> pending;
+
+        while (heapEnd != 0 && runExtent<Value>(runSize + 1, codecBlock) <= run.size) {
+            std::pop_heap(heap.begin(), heap.begin() + heapEnd, greater);
+            Value & slot = heap[heapEnd - 1];
+            if constexpr (kCombines<Combine>) {
+                if (pending && !(*pending < slot)) {
+                    combine(*pending, slot);
+                } else if (runSize < limit) {
+                    if (pending)
+                        writer.push(std::move(*pending));
+                    pending = slot;
+                    ++runSize;
+                }
+            } else if (runSize < limit) {
+                writer.push(slot);
+                ++runSize;
+            }
+            if (!reader.empty()) {
+                bool const fitsCurrentRun = !(reader.head() < slot);
+                slot = reader.head();
+                reader.next();
+                if (fitsCurrentRun)
+                    std::push_heap(heap.begin(), heap.begin() + heapEnd, greater);
+                else
+                    --heapEnd;
+            } else {
+                // The input is drained: close the gap by moving the last parked value into it.
+                --heapEnd;
+                if (&slot != &heap.back())
+                    slot = std::move(heap.back());
+                heap.pop_back();
+            }
+        }
+        if (pending)
+            writer.push(std::move(*pending));
+        writer.finish();
+        tapes.shrink(run, writer.extent());
+        run.count = runSize;
+        runs.push_back(run);
+
+        // Whatever is left, parked or not, starts the next run.
+        std::make_heap(heap.begin(), heap.end(), greater);
+        heapEnd = heap.size();
+    }
+}
+
+/*
+ * Forms the runs of in on the tapes of tmp, keeping the first limit values of each, and merges
+ * them until at most fanIn() are left for the final merge, which is up to the caller. Every
+ * merged run is cut to limit values too. The combiner is applied to every run as it is formed
+ * and again by every merge; natural runs are read in place and only combined by the merges.
+ * Run formation and every merge pass are phases of the monitor, if there is one.
+ */
+template<typename Value, typename TapesContainer, typename Combine>
+std::vector<Run<Value>> sortRuns(Tape<Value> * in, TapesContainer & tmp, std::size_t memoryValues,
+                                 SortOptions const & options, std::size_t limit, Combine combine,
+                                 NaturalRuns<Value> & natural, MemoryBudget & budget,
+                                 SortMonitor * monitor = nullptr) {
+    std::size_t const inputSize = in->size();
+    std::size_t const codecBlock = detail::codecBlock<Value>(memoryValues, options);
+    // Encoded chunks are written one at a time through a writer without an I/O block.
+    std::size_t const codecMemory = codecBlock == 0 ? 0 : bufferMemory<Value>(0, codecBlock);
+    // Every chunk buffer that can be alive at the same time gets an equal share of the rest.
+    std::size_t const chunkSize =
+        (memoryValues > codecMemory ? memoryValues - codecMemory : 0) / (options.threads + 1);
+    // For replacement selection an eighth of the memory goes to the input and output blocks,
+    // the rest to the heap.
+    std::size_t const blockSize = std::max<std::size_t>(1, memoryValues / 16);
+    std::size_t const blocksMemory =
+        bufferMemory<Value>(blockSize, 0) + bufferMemory<Value>(blockSize, codecBlock);
+    std::size_t const heapSize = memoryValues > blocksMemory ? memoryValues - blocksMemory : 0;
+    bool const replacementSelection =
+        options.runGeneration == RunGeneration::ReplacementSelection;
+
+    if ((replacementSelection ? heapSize : chunkSize) == 0)
+        throw std::runtime_error("Insufficient memory");
+
+    std::size_t const fanIn = detail::fanIn<Value>(memoryValues, options);
+    std::size_t const expectedRuns = replacementSelection ? (inputSize + heapSize - 1) / heapSize
+                                                          : (inputSize + chunkSize - 1) / chunkSize;
+    // Values that make it to the tapes.
+    std::size_t const keptSize =
+        limit < inputSize / std::max<std::size_t>(expectedRuns, 1) ? expectedRuns * limit
+                                                                   : inputSize;
+    // Tape positions they take at most.
+    std::size_t const tapeSize = runsExtent<Value>(keptSize, expectedRuns, codecBlock);
+    TapeGroup<Value> first;
+    TapeGroup<Value> second;
+    // Natural runs stay on the input, a sorted one needs no temporary space at all.
+    splitTapes(tmp, expectedRuns > fanIn, tapeSize, natural.enabled(), first, second);
+
+    if (monitor != nullptr)
+        monitor->beginPhase("run formation", inputSize, false);
+    std::vector<Run<Value>> runs;
+    if (replacementSelection) {
+        formRunsReplacementSelection(in, first, heapSize, blockSize, codecBlock, limit, combine,
+                                     budget, runs);
+    } else if (options.threads == 0) {
+        formRuns(in, first, chunkSize, codecBlock, limit, combine, natural, budget, runs);
+    } else {
+        formRunsPipelined(in, first, chunkSize, options.threads, codecBlock, limit, combine,
+                          natural, budget, runs);
+    }
+    // Natural runs aren't combined, their first limit values may hold fewer keys.
+    std::size_t const sortedRuns = runs.size();
+    natural.finish(kCombines<Combine> ? kUnlimited : limit, runs);
+    if (monitor != nullptr) {
+        monitor->endPhase(runs.size());
+        monitor->formed(runs.size(), runs.size() - sortedRuns);
+    }
+    return mergePasses(
+        std::move(runs), first, second, fanIn,
+        [codecBlock, limit](auto & tapes, std::size_t count) {
+            return allocateRun(tapes, std::min(count, limit), codecBlock);
+        },
+        [&](auto const & group, auto & target) {
+            return merge(group, target, false, memoryValues, options, budget, combine, monitor);
+        },
+        monitor);
+}
+
+// Body of externalSort() once the temporary tapes are there.
+template<typename Value, typename Combine>
+std::size_t sortTapes(Tape<Value> * in, Tape<Value> * out, std::vector<Tape<Value> *> & tmp,
+                      std::size_t memoryValues, SortOptions const & options, Combine combine,
+                      MemoryBudget & budget, SortMonitor * monitor) {
+    std::size_t const inputSize = in->size();
+    // A combined output is never a plain copy of the input.
+    NaturalRuns<Value> natural{ options, in, kCombines<Combine> ? nullptr : out };
+    auto runs = sortRuns(in, tmp, memoryValues, options, kUnlimited, combine, natural, budget,
+                         monitor);
+    if (natural.copied() == inputSize)
+        return inputSize;
+    Run<Value> target{ out, 0, inputSize, inputSize };
+    if (monitor != nullptr)
+        monitor->beginPhase("final merge", inputSize, true);
+    merge(runs, target, true, memoryValues, options, budget, combine, monitor);
+    if (monitor != nullptr)
+        monitor->endPhase(1);
+    return target.count;
+}
+
+}  // namespace detail
+
+/*
+ * Sorts in into out through the temporary tapes tmp and returns the number of values written.
+ * The value buffers of the sort take at most options.memoryBytes, which is enforced: going over
+ * it is a bug and throws. Without temporary tapes, options.temporaryTapes anonymous files are
+ * created in options.temporaryDirectory.
+ *
+ * An optional combiner folds values that are equivalent under operator< into one: combine(acc,
+ * value) merges value into acc, which must stay equivalent to it; Unique just drops value. It
+ * is applied to every run as it is formed and in every merge pass, so duplicates never reach
+ * the temporary tapes twice, and the output holds one value per key.
+ *
+ * With options.stats or options.progress, every tape is wrapped in a CountingTape for the
+ * duration of the sort, which also counts what the phases read and write.
+ */
+template<typename Value, typename TapePtr = Tape<Value> *,
+         typename TapesContainer = std::vector<TapePtr>, typename Combine = detail::NoCombine>
+std::size_t externalSort(TapePtr && in, TapePtr && out, TapesContainer & tmp,
+                         SortOptions const & options = SortOptions{}, Combine combine = Combine{}) {
+    if constexpr (std::is_trivially_copyable<Value>::value) {
+        if (tmp.empty() && options.temporaryTapes != 0) {
+            auto files = makeTemporaryTapes<Value>(options.temporaryTapes,
+                                                   options.temporaryDirectory.empty()
+                                                       ? defaultTemporaryDirectory()
+                                                       : options.temporaryDirectory);
+            return externalSort<Value>(std::forward<TapePtr>(in), std::forward<TapePtr>(out),
+                                       files, options, combine);
+        }
+    }
+
+    std::size_t const memoryValues = options.memoryBytes / sizeof(Value);
+    MemoryBudget budget{ memoryValues * sizeof(Value) };
+    detail::SortMonitor monitor{ options.stats, options.progress };
+    if (!monitor.enabled()) {
+        std::vector<Tape<Value> *> tapes;
+        for (auto & tape : tmp)
+            tapes.push_back(detail::rawTape(tape));
+        return detail::sortTapes(detail::rawTape(in), detail::rawTape(out), tapes, memoryValues,
+                                 options, combine, budget, nullptr);
+    }
+
+    detail::CountingTape<Value> countingIn{ detail::rawTape(in), "input", &monitor };
+    detail::CountingTape<Value> countingOut{ detail::rawTape(out), "output", &monitor };
+    std::vector<detail::CountingTape<Value>> countingTmp;
+    countingTmp.reserve(tmp.size());
+    std::vector<Tape<Value> *> tapes;
+    for (auto & tape : tmp) {
+        countingTmp.emplace_back(detail::rawTape(tape),
+                                 "temporary " + std::to_string(countingTmp.size()), &monitor);
+        tapes.push_back(&countingTmp.back());
+    }
+    std::size_t const written = detail::sortTapes(&countingIn, &countingOut, tapes, memoryValues,
+                                                  options, combine, budget, &monitor);
+    std::vector<TapeStats> tapeStats{ countingIn.stats(), countingOut.stats() };
+    for (auto const & tape : countingTmp)
+        tapeStats.push_back(tape.stats());
+    monitor.finish(std::move(tapeStats), budget.peak());
+    return written;
+}
+
+// Compile-time memory budget, overrides options.memoryBytes.
+template<typename Value, std::size_t kMaxMemorySize, typename TapePtr = Tape<Value> *,
+         typename TapesContainer = std::vector<TapePtr>, typename Combine = detail::NoCombine>
+std::size_t externalSort(TapePtr && in, TapePtr && out, TapesContainer & tmp,
+                         SortOptions options = SortOptions{}, Combine combine = Combine{}) {
+    options.memoryBytes = kMaxMemorySize;
+    return externalSort<Value>(std::forward<TapePtr>(in), std::forward<TapePtr>(out), tmp,
+                               options, combine);
 }
 
 }  // namespace external_sort
@@ -0,0 +1,370 @@
+#pragma once
+
+#include "tape.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace external_sort
+{
+
+namespace detail
+{
+
+inline std::system_error systemError(char const * what) {
+    return std::system_error{ errno, std::generic_category(), what };
+}
+
+inline void preadAll(int fd, void * buffer, std::size_t bytes, std::size_t offset) {
+    auto * dst = static_cast<char *>(buffer);
+    while (bytes != 0) {
+        ssize_t n = ::pread(fd, dst, bytes, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw systemError("pread");
+        }
+        if (n == 0)
+            throw std::runtime_error("Unexpected end of file");
+        dst += n;
+        bytes -= static_cast<std::size_t>(n);
+        offset += static_cast<std::size_t>(n);
+    }
+}
+
+inline void pwriteAll(int fd, void const * data, std::size_t bytes, std::size_t offset) {
+    auto const * src = static_cast<char const *>(data);
+    while (bytes != 0) {
+        ssize_t n = ::pwrite(fd, src, bytes, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw systemError("pwrite");
+        }
+        src += n;
+        bytes -= static_cast<std::size_t>(n);
+        offset += static_cast<std::size_t>(n);
+    }
+}
+
+inline std::size_t fileSize(int fd) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+        throw systemError("fstat");
+    return static_cast<std::size_t>(st.st_size);
+}
+
+}  // namespace detail
+
+enum class OpenMode
+{
+    Read,       // existing file, writes are rejected
+    Write,      // created or truncated
+    ReadWrite,  // created if missing, contents kept
+};
+
+/*
+ * Tape over a file of raw values accessed with pread()/pwrite(). Per-value read() and write()
+ * go through a single cached block of blockSize values. readBlock() reads straight into the
+ * caller's buffer unless it starts in the cached block, so probing single values far apart
+ * costs a pread() of just those values; writeBlock() of at least a block bypasses the cache.
+ */
+template<typename Value>
+class FileTape : public Tape<Value>
+{
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "FileTape stores values as raw bytes");
+
+public:
+    using value_type = Value;
+    static constexpr std::size_t kDefaultBlockSize =
+        std::max<std::size_t>(1, (1024 * 1024) / sizeof(Value));
+    static constexpr std::size_t kUnlimited = ~std::size_t(0) / sizeof(Value);
+
+    FileTape(std::string const & path, OpenMode mode, std::size_t capacity = kUnlimited,
+             std::size_t blockSize = kDefaultBlockSize)
+        : FileTape(openFile(path, mode), mode, capacity, blockSize) {}
+
+    // Takes ownership of an already opened descriptor.
+    FileTape(int fd, OpenMode mode, std::size_t capacity = kUnlimited,
+             std::size_t blockSize = kDefaultBlockSize)
+        : fd_{ fd }
+        , readOnly_{ mode == OpenMode::Read }
+        , size_{ detail::fileSize(fd) / sizeof(Value) }
+        , capacity_{ readOnly_ ? size_ : capacity }
+        , blockSize_{ std::max<std::size_t>(1, blockSize) }
+        , block_(blockSize_) {}
+
+    FileTape(FileTape const &) = delete;
+    FileTape & operator=(FileTape const &) = delete;
+
+    ~FileTape() override {
+        try {
+            flushBlock();
+        } catch (...) {
+        }
+        ::close(fd_);
+    }
+
+    std::size_t pos() const override { return cursor_; }
+    void pos(std::size_t idx) override { cursor_ = idx; }
+
+    value_type read() const override {
+        if (cursor_ >= size_)
+            throw std::runtime_error("Read out of data bounds");
+        if (!cached(cursor_))
+            load(cursor_);
+        return block_[cursor_ - blockStart_];
+    }
+
+    std::size_t size() const override { return size_; }
+    std::size_t capacity() const override { return capacity_; }
+
+    void write(value_type value) override {
+        checkWrite(1);
+        if (!(cursor_ >= blockStart_ && cursor_ < blockStart_ + blockSize_
+              && cursor_ <= blockStart_ + valid_))
+            load(cursor_);
+        std::size_t const idx = cursor_ - blockStart_;
+        block_[idx] = value;
+        valid_ = std::max(valid_, idx + 1);
+        dirtyBegin_ = std::min(dirtyBegin_, idx);
+        dirtyEnd_ = std::max(dirtyEnd_, idx + 1);
+        size_ = std::max(size_, cursor_ + 1);
+    }
+
+    void flush() override { flushBlock(); }
+
+    std::size_t readBlock(value_type * buffer, std::size_t count) override {
+        std::size_t const n = cursor_ < size_ ? std::min(count, size_ - cursor_) : 0;
+        if (n >= blockSize_ || (n != 0 && !cached(cursor_))) {
+            flushBlock();
+            detail::preadAll(fd_, buffer, n * sizeof(Value), cursor_ * sizeof(Value));
+            cursor_ += n;
+            return n;
+        }
+        std::size_t done = 0;
+        while (done < n) {
+            if (!cached(cursor_))
+                load(cursor_);
+            std::size_t const idx = cursor_ - blockStart_;
+            std::size_t const chunk = std::min(n - done, valid_ - idx);
+            std::memcpy(buffer + done, block_.data() + idx, chunk * sizeof(Value));
+            done += chunk;
+            cursor_ += chunk;
+        }
+        return n;
+    }
+
+    void writeBlock(value_type const * data, std::size_t count) override {
+        checkWrite(count);
+        if (count < blockSize_) {
+            Tape<Value>::writeBlock(data, count);
+            return;
+        }
+        // The cached block may overlap the written range, drop it rather than patch it.
+        flushBlock();
+        valid_ = 0;
+        detail::pwriteAll(fd_, data, count * sizeof(Value), cursor_ * sizeof(Value));
+        cursor_ += count;
+        size_ = std::max(size_, cursor_);
+    }
+
+    int fd() const { return fd_; }
+
+private:
+    static int openFile(std::string const & path, OpenMode mode) {
+        int flags = O_CLOEXEC;
+        switch (mode) {
+        case OpenMode::Read:
+            flags |= O_RDONLY;
+            break;
+        case OpenMode::Write:
+            flags |= O_RDWR | O_CREAT | O_TRUNC;
+            break;
+        case OpenMode::ReadWrite:
+            flags |= O_RDWR | O_CREAT;
+            break;
+        }
+        int fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0)
+            throw detail::systemError(("open " + path).c_str());
+        return fd;
+    }
+
+    void checkWrite(std::size_t count) const {
+        if (readOnly_)
+            throw std::logic_error("Tape is read-only");
+        if (cursor_ + count > capacity_)
+            throw std::runtime_error("Can't write beyond end of data");
+    }
+
+    bool cached(std::size_t idx) const { return idx >= blockStart_ && idx < blockStart_ + valid_; }
+
+    void load(std::size_t idx) const {
+        flushBlock();
+        blockStart_ = idx;
+        valid_ = idx < size_ ? std::min(blockSize_, size_ - idx) : 0;
+        if (valid_ != 0)
+            detail::preadAll(fd_, block_.data(), valid_ * sizeof(Value), idx * sizeof(Value));
+    }
+
+    void flushBlock() const {
+        if (dirtyBegin_ >= dirtyEnd_)
+            return;
+        detail::pwriteAll(fd_, block_.data() + dirtyBegin_,
+                          (dirtyEnd_ - dirtyBegin_) * sizeof(Value),
+                          (blockStart_ + dirtyBegin_) * sizeof(Value));
+        dirtyBegin_ = ~std::size_t(0);
+        dirtyEnd_ = 0;
+    }
+
+    int fd_;
+    bool readOnly_;
+    std::size_t cursor_ = 0;
+    std::size_t size_;
+    std::size_t capacity_;
+    std::size_t blockSize_;
+    // The cached block is shared by the const read() path, hence mutable.
+    mutable std::vector<Value> block_;
+    mutable std::size_t blockStart_ = 0;
+    mutable std::size_t valid_ = 0;
+    mutable std::size_t dirtyBegin_ = ~std::size_t(0);
+    mutable std::size_t dirtyEnd_ = 0;
+};
+
+/*
+ * Read-only tape over a memory mapped file, meant for inputs. The mapping is advised as
+ * sequential, so the kernel reads ahead aggressively and drops pages behind the cursor.
+ */
+template<typename Value>
+class MmapTape : public Tape<Value>
+{
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "MmapTape stores values as raw bytes");
+
+public:
+    using value_type = Value;
+
+    explicit MmapTape(std::string const & path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw detail::systemError(("open " + path).c_str());
+        try {
+            std::size_t const bytes = detail::fileSize(fd);
+            size_ = bytes / sizeof(Value);
+            if (size_ != 0) {
+                void * p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED)
+                    throw detail::systemError("mmap");
+                data_ = static_cast<Value const *>(p);
+                bytes_ = bytes;
+                ::madvise(p, bytes, MADV_SEQUENTIAL);
+            }
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
+    MmapTape(MmapTape const &) = delete;
+    MmapTape & operator=(MmapTape const &) = delete;
+
+    ~MmapTape() override {
+        if (data_ != nullptr)
+            ::munmap(const_cast<Value *>(data_), bytes_);
+    }
+
+    std::size_t pos() const override { return cursor_; }
+    void pos(std::size_t idx) override { cursor_ = idx; }
+
+    value_type read() const override {
+        if (cursor_ >= size_)
+            throw std::runtime_error("Read out of data bounds");
+        return data_[cursor_];
+    }
+
+    std::size_t size() const override { return size_; }
+    std::size_t capacity() const override { return size_; }
+
+    void write(value_type) override { throw std::logic_error("Tape is read-only"); }
+
+    void flush() override {}
+
+    std::size_t readBlock(value_type * buffer, std::size_t count) override {
+        std::size_t const n = cursor_ < size_ ? std::min(count, size_ - cursor_) : 0;
+        if (n != 0)
+            std::memcpy(buffer, data_ + cursor_, n * sizeof(Value));
+        cursor_ += n;
+        return n;
+    }
+
+    void writeBlock(value_type const *, std::size_t) override {
+        throw std::logic_error("Tape is read-only");
+    }
+
+    Value const * data() const { return data_; }
+
+private:
+    Value const * data_ = nullptr;
+    std::size_t bytes_ = 0;
+    std::size_t size_ = 0;
+    std::size_t cursor_ = 0;
+};
+
+// $TMPDIR when set, /tmp otherwise.
+inline std::string defaultTemporaryDirectory() {
+    char const * dir = std::getenv("TMPDIR");
+    return dir != nullptr && *dir != '\0' ? dir : "/tmp";
+}
+
+/*
+ * Creates an anonymous file tape in directory. The file is unlinked right away, so it never
+ * outlives the tape, even if the process crashes.
+ */
+template<typename Value>
+std::unique_ptr<FileTape<Value>>
+makeTemporaryTape(std::string const & directory, std::size_t capacity = FileTape<Value>::kUnlimited,
+                  std::size_t blockSize = FileTape<Value>::kDefaultBlockSize) {
+    std::string path = directory + "/external_sort.XXXXXX";
+    int fd = ::mkstemp(path.data());
+    if (fd < 0)
+        throw detail::systemError(("mkstemp " + path).c_str());
+    ::unlink(path.c_str());
+    try {
+        return std::make_unique<FileTape<Value>>(fd, OpenMode::ReadWrite, capacity, blockSize);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+template<typename Value>
+std::vector<std::unique_ptr<Tape<Value>>>
+makeTemporaryTapes(std::size_t count, std::string const & directory = defaultTemporaryDirectory(),
+                   std::size_t capacity = FileTape<Value>::kUnlimited,
+                   std::size_t blockSize = FileTape<Value>::kDefaultBlockSize) {
+    std::vector<std::unique_ptr<Tape<Value>>> tapes;
+    tapes.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        tapes.emplace_back(makeTemporaryTape<Value>(directory, capacity, blockSize));
+    return tapes;
+}
+
+}  // namespace external_sort
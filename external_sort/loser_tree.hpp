@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace external_sort
+{
+namespace detail
+{
+
+/*
+ * Tournament tree of losers over k sources. The current head of every source is cached in a
+ * flat array, internal node n keeps the index of the source that lost the match played at n and
+ * node 0 keeps the overall winner. Replacing the head of the winner replays a single
+ * leaf-to-root path, so every output value costs ceil(log2(k)) comparisons and no allocations.
+ * Exhausted sources lose every match; ties are won by the source with the lower index.
+ */
+template<typename Value, typename Less = std::less<Value>>
+class LoserTree
+{
+public:
+    static constexpr std::size_t kNone = ~std::size_t(0);
+
+    explicit LoserTree(std::size_t sources, Less less = Less{})
+        : less_{ std::move(less) }
+        , keys_(sources)
+        , exhausted_(sources, true)
+        , tree_(std::max<std::size_t>(sources, 1), kNone) {}
+
+    std::size_t sources() const { return keys_.size(); }
+
+    // Sets the initial head of a source, call build() once all of them are set.
+    void set(std::size_t source, Value value) {
+        keys_[source] = std::move(value);
+        exhausted_[source] = false;
+    }
+
+    void build() {
+        std::size_t const k = sources();
+        if (k == 0)
+            return;
+        std::vector<std::size_t> winners(2 * k);
+        for (std::size_t i = 0; i < k; ++i)
+            winners[k + i] = i;
+        for (std::size_t node = k - 1; node > 0; --node) {
+            std::size_t const a = winners[2 * node];
+            std::size_t const b = winners[2 * node + 1];
+            if (beats(a, b)) {
+                winners[node] = a;
+                tree_[node] = b;
+            } else {
+                winners[node] = b;
+                tree_[node] = a;
+            }
+        }
+        tree_[0] = k == 1 ? 0 : winners[1];
+    }
+
+    bool empty() const { return tree_[0] == kNone || exhausted_[tree_[0]]; }
+
+    std::size_t top() const { return tree_[0]; }
+
+    Value const & topValue() const { return keys_[tree_[0]]; }
+
+    // Key comparisons made so far.
+    std::uint64_t comparisons() const { return comparisons_; }
+
+    // The winner source advanced to its next value.
+    void replaceTop(Value value) {
+        std::size_t const winner = tree_[0];
+        keys_[winner] = std::move(value);
+        replay(winner);
+    }
+
+    // The winner source ran out of values.
+    void popTop() {
+        std::size_t const winner = tree_[0];
+        exhausted_[winner] = true;
+        replay(winner);
+    }
+
+private:
+    bool beats(std::size_t a, std::size_t b) const {
+        if (exhausted_[a])
+            return false;
+        if (exhausted_[b])
+            return true;
+        // The lower index wins ties, so one comparison in the right direction settles it.
+        ++comparisons_;
+        return a < b ? !less_(keys_[b], keys_[a]) : less_(keys_[a], keys_[b]);
+    }
+
+    void replay(std::size_t source) {
+        std::size_t winner = source;
+        for (std::size_t node = (source + sources()) / 2; node > 0; node /= 2) {
+            if (beats(tree_[node], winner))
+                std::swap(tree_[node], winner);
+        }
+        tree_[0] = winner;
+    }
+
+    Less less_;
+    std::vector<Value> keys_;
+    // Bytes rather than vector<bool>, every match reads two of them.
+    std::vector<unsigned char> exhausted_;
+    std::vector<std::size_t> tree_;
+    mutable std::uint64_t comparisons_ = 0;
+};
+
+}  // namespace detail
+}  // namespace external_sort
@@ -1,10 +1,27 @@
 #include "external_sort.hpp"
+#include "file_tape.hpp"
+#include "radix_sort.hpp"
+#include "record_sort.hpp"
+#include "sorted_stream.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 /*
+ * Runs the checks below first, which report to stderr and fail the exit code, then prints the
+ * input and the output of a sort of random values.
  * Testing:
  * ./external_sort > test.txt
  * (for j in $(for i in $(head -n 1 test.txt); do echo $i; done | sort -n ); do echo -n $j; \
@@ -43,6 +60,23 @@ public:
 
     void flush() override {}
 
+    std::size_t readBlock(value_type * buffer, std::size_t count) override {
+        std::size_t const n = cursor < data.size() ? std::min(count, data.size() - cursor) : 0;
+        std::copy_n(data.begin() + cursor, n, buffer);
+        cursor += n;
+        return n;
+    }
+
+    void writeBlock(value_type const * values, std::size_t count) override {
+        if (cursor + count > data.capacity())
+            throw std::runtime_error("Can't write beyond end of data");
+
+        if (cursor + count > data.size())
+            data.resize(cursor + count);
+        std::copy_n(values, count, data.begin() + cursor);
+        cursor += count;
+    }
+
     std::vector<Value> const & getData() const { return data; }
 
 private:
@@ -50,12 +84,535 @@ private:
     std::vector<Value> data;
 };
 
+namespace
+{
+
+std::vector<int> randomValues(std::size_t size, int max, std::mt19937 & rng) {
+    std::uniform_int_distribution<int> distr(0, max);
+    std::vector<int> data(size);
+    for (auto & value : data)
+        value = distr(rng);
+    return data;
+}
+
+template<typename Value = int>
+std::vector<std::unique_ptr<external_sort::Tape<Value>>>
+makeTapes(std::vector<std::size_t> const & tapeSizes) {
+    std::vector<std::unique_ptr<external_sort::Tape<Value>>> tmp;
+    for (std::size_t size : tapeSizes)
+        tmp.push_back(std::make_unique<VectorTape<Value>>(size));
+    return tmp;
+}
+
+// The first limit values of data sorted by std::sort.
+template<typename Value>
+std::vector<Value> sortedPrefix(std::vector<Value> data, std::size_t limit) {
+    std::sort(data.begin(), data.end());
+    data.resize(std::min(limit, data.size()));
+    return data;
+}
+
+// Whether the sort of data through temporary tapes of tapeSizes matches std::sort, followed by
+// std::unique with a combiner.
+template<typename Value, typename Combine = external_sort::detail::NoCombine>
+bool checkSort(std::string const & name, std::vector<Value> const & data,
+               std::vector<std::size_t> const & tapeSizes, external_sort::SortOptions options,
+               Combine combine = Combine{}) {
+    auto in = std::make_unique<VectorTape<Value>>(data);
+    auto out = std::make_unique<VectorTape<Value>>(data.size());
+    auto tmp = makeTapes<Value>(tapeSizes);
+    std::vector<Value> expected = sortedPrefix(data, data.size());
+    if (external_sort::detail::kCombines<Combine>)
+        expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+    try {
+        std::size_t const written =
+            external_sort::externalSort<Value>(in, out, tmp, options, combine);
+        if (written == expected.size() && out->getData() == expected)
+            return true;
+        std::cerr << name << ": wrong output" << std::endl;
+    } catch (std::exception const & e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+    }
+    return false;
+}
+
+// Whether a sort of data, which is made of natural runs, matches std::sort without writing to
+// temporary tapes of 10 values.
+bool checkNatural(std::string const & name, std::vector<int> const & data,
+                  external_sort::SortOptions options) {
+    auto in = std::make_unique<VectorTape<int>>(data);
+    auto out = std::make_unique<VectorTape<int>>(data.size());
+    auto tmp = makeTapes({ 10, 10, 10, 10 });
+    try {
+        std::size_t const written = external_sort::externalSort<int>(in, out, tmp, options);
+        bool const untouched = std::all_of(tmp.begin(), tmp.end(),
+                                           [](auto const & tape) { return tape->size() == 0; });
+        if (written == data.size() && out->getData() == sortedPrefix(data, data.size())
+            && untouched)
+            return true;
+        std::cerr << name << ": wrong output" << std::endl;
+    } catch (std::exception const & e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+    }
+    return false;
+}
+
+// Whether the first limit values pulled from a SortedStream over data match std::sort.
+bool checkStream(std::string const & name, std::vector<int> const & data, std::size_t limit,
+                 std::vector<std::size_t> const & tapeSizes, external_sort::SortOptions options) {
+    auto in = std::make_unique<VectorTape<int>>(data);
+    auto tmp = makeTapes(tapeSizes);
+    try {
+        external_sort::SortedStream<int> stream{ in, tmp, options, limit };
+        std::vector<int> const result(stream.begin(), stream.end());
+        if (result == sortedPrefix(data, limit))
+            return true;
+        std::cerr << name << ": wrong output" << std::endl;
+    } catch (std::exception const & e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+    }
+    return false;
+}
+
+// Whether externalSortTopK() of data writes its k smallest values in order.
+bool checkTopK(std::string const & name, std::vector<int> const & data, std::size_t k,
+               std::vector<std::size_t> const & tapeSizes, external_sort::SortOptions options) {
+    auto in = std::make_unique<VectorTape<int>>(data);
+    auto out = std::make_unique<VectorTape<int>>(k);
+    auto tmp = makeTapes(tapeSizes);
+    std::vector<int> const expected = sortedPrefix(data, k);
+    try {
+        std::size_t const written = external_sort::externalSortTopK<int>(in, out, k, tmp, options);
+        if (written == expected.size() && out->getData() == expected)
+            return true;
+        std::cerr << name << ": wrong output" << std::endl;
+    } catch (std::exception const & e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+    }
+    return false;
+}
+
+// Random keys over the whole range of Value, with its extremes, zeros and, for floating point,
+// infinities, denormals and, with nans, NaNs of both signs mixed in.
+template<typename Value>
+std::vector<Value> randomKeys(std::size_t size, bool nans, std::mt19937 & rng) {
+    using limits = std::numeric_limits<Value>;
+    std::vector<Value> specials{ limits::lowest(), limits::max(), limits::min(), Value(0) };
+    if constexpr (std::is_floating_point<Value>::value) {
+        specials.insert(specials.end(), { Value(-0.0), limits::infinity(), -limits::infinity(),
+                                          limits::denorm_min(), -limits::denorm_min() });
+        if (nans)
+            specials.insert(specials.end(), { limits::quiet_NaN(), -limits::quiet_NaN() });
+    } else {
+        specials.push_back(Value(-1));
+    }
+    std::uniform_int_distribution<std::size_t> pick(0, specials.size() - 1);
+    std::uniform_int_distribution<int> exponent(limits::min_exponent, limits::max_exponent);
+    std::uniform_int_distribution<std::int64_t> bits(std::numeric_limits<std::int64_t>::min(),
+                                                     std::numeric_limits<std::int64_t>::max());
+    std::vector<Value> data(size);
+    for (auto & value : data) {
+        if (rng() % 8 == 0)
+            value = specials[pick(rng)];
+        else if constexpr (std::is_floating_point<Value>::value)
+            value = std::ldexp(Value(bits(rng)) / Value(1ULL << 63), exponent(rng) - 1);
+        else
+            value = Value(bits(rng));
+    }
+    return data;
+}
+
+// Bits of values in the order radix sort gives them: std::sort, with -0.0 before 0.0 and NaNs
+// first when negative and last otherwise, where std::sort can't place them.
+template<typename Value>
+std::vector<Value> radixOrder(std::vector<Value> data) {
+    if constexpr (std::is_floating_point<Value>::value) {
+        auto const nan = [](Value v) { return std::isnan(v); };
+        auto const last = std::stable_partition(data.begin(), data.end(), [](Value v) {
+            return std::isnan(v) && std::signbit(v);
+        });
+        auto const numbers = std::stable_partition(last, data.end(), nan);
+        std::rotate(last, numbers, data.end());
+        std::sort(last, data.end() - (numbers - last), [](Value a, Value b) {
+            return a < b || (a == b && std::signbit(a) && !std::signbit(b));
+        });
+    } else {
+        std::sort(data.begin(), data.end());
+    }
+    return data;
+}
+
+// Whether radix sort of data, short enough to go to the comparison sort or long enough for radix
+// passes, gives the same bits as radixOrder().
+template<typename Value>
+bool checkRadix(std::string const & name, std::vector<Value> const & data) {
+    std::vector<Value> sorted = data;
+    external_sort::detail::sortChunk(sorted.data(), sorted.data() + sorted.size());
+    std::vector<Value> const expected = radixOrder(data);
+    if (std::memcmp(sorted.data(), expected.data(), data.size() * sizeof(Value)) == 0)
+        return true;
+    std::cerr << name << ": wrong order" << std::endl;
+    return false;
+}
+
+// Radix sort of every kind of key, on its own and as the chunk sort of an external sort,
+// against std::sort. External sorts only see NaN-free keys, merging needs an order.
+template<typename Value>
+bool checkKeys(std::string const & type, external_sort::SortOptions const & options,
+               std::mt19937 & rng) {
+    bool ok = true;
+    for (std::size_t size : { std::size_t(50), std::size_t(20000) }) {
+        ok = checkRadix(std::to_string(size) + " " + type + " keys, radix sort",
+                        randomKeys<Value>(size, true, rng))
+             && ok;
+    }
+    std::size_t const size = 20000;
+    return checkSort(std::to_string(size) + " " + type + " keys",
+                     randomKeys<Value>(size, false, rng), { size, size, size, size }, options)
+           && ok;
+}
+
+// Records of up to maxLength bytes of any value, a fifth of them empty and a third sharing their
+// first 8 bytes, so that only the full comparison after the key prefix tells them apart.
+std::vector<std::string> randomRecords(std::size_t count, std::size_t maxLength,
+                                       std::mt19937 & rng) {
+    std::string const shared{ "prefix\0\xff", 8 };
+    std::vector<std::string> records(count);
+    for (auto & record : records) {
+        std::size_t const kind = rng() % 15;
+        if (kind < 3)
+            continue;
+        if (kind < 8)
+            record = shared.substr(0, kind == 3 ? rng() % 9 : 8);
+        std::size_t const length = rng() % (maxLength - record.size() + 1);
+        for (std::size_t i = 0; i < length; ++i)
+            record.push_back(char(rng() % 4 == 0 ? "\0\xff"[rng() % 2] : rng()));
+    }
+    return records;
+}
+
+// Whether externalSortRecords() of records through temporary tapes of tapeSizes bytes orders
+// them like std::sort of std::string.
+bool checkRecords(std::string const & name, std::vector<std::string> records,
+                  std::vector<std::size_t> const & tapeSizes, external_sort::SortOptions options) {
+    std::size_t bytes = 0;
+    for (auto const & record : records)
+        bytes += sizeof(external_sort::RecordLength) + record.size();
+    auto in = std::make_unique<VectorTape<char>>(bytes);
+    auto out = std::make_unique<VectorTape<char>>(bytes);
+    auto tmp = makeTapes<char>(tapeSizes);
+    try {
+        external_sort::RecordWriter writer{ in.get() };
+        for (auto const & record : records)
+            writer.push(record);
+        writer.finish();
+        external_sort::externalSortRecords(in, out, tmp, options);
+        std::vector<std::string> sorted;
+        for (external_sort::RecordReader reader{ out.get(), 0, out->size() }; !reader.empty();
+             reader.next())
+            sorted.emplace_back(reader.head());
+        std::sort(records.begin(), records.end());
+        if (sorted == records)
+            return true;
+        std::cerr << name << ": wrong output" << std::endl;
+    } catch (std::exception const & e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+    }
+    return false;
+}
+
+// Whether values written to a FileTape with a cache of 7 values, one at a time and in blocks
+// shorter and longer than that, some of them over earlier ones, read back the same from the
+// tape, between the writes and a piece at a time across the block boundaries once flushed, and
+// from an MmapTape of the file; and whether the file then sorts through temporary file tapes.
+bool checkFileTapes(std::mt19937 & rng) {
+    std::string path = external_sort::defaultTemporaryDirectory() + "/external_sort.XXXXXX";
+    int const fd = ::mkstemp(path.data());
+    if (fd < 0) {
+        std::cerr << "file tapes: can't create " << path << std::endl;
+        return false;
+    }
+    bool ok = false;
+    try {
+        std::vector<int> expected;
+        {
+            external_sort::FileTape<int> tape{ fd, external_sort::OpenMode::ReadWrite,
+                                               external_sort::FileTape<int>::kUnlimited, 7 };
+            while (expected.size() < 5000) {
+                std::vector<int> const block = randomValues(rng() % 20, 1 << 30, rng);
+                std::size_t const at = rng() % 4 == 0 ? rng() % (expected.size() + 1)
+                                                      : expected.size();
+                tape.pos(at);
+                if (block.size() == 1)
+                    tape.write(block[0]);
+                else
+                    tape.writeBlock(block.data(), block.size());
+                expected.resize(std::max(expected.size(), at + block.size()));
+                std::copy(block.begin(), block.end(), expected.begin() + at);
+
+                std::size_t const from = rng() % expected.size();
+                std::vector<int> back(std::min<std::size_t>(rng() % 20, expected.size() - from));
+                tape.pos(from);
+                ok = tape.readBlock(back.data(), back.size()) == back.size()
+                     && std::equal(back.begin(), back.end(), expected.begin() + from);
+                if (!ok)
+                    throw std::runtime_error("wrong values read back before a flush");
+            }
+            tape.flush();
+
+            std::vector<int> back(expected.size());
+            tape.pos(0);
+            for (std::size_t done = 0; done < back.size();) {
+                std::size_t const n = rng() % 20;
+                if (n == 1)
+                    back[done++] = tape.read();
+                else
+                    done += tape.readBlock(back.data() + done, n);
+                tape.pos(done);
+            }
+            ok = tape.size() == expected.size() && back == expected;
+        }
+
+        external_sort::MmapTape<int> mapped{ path };
+        std::vector<int> back(mapped.size());
+        mapped.pos(0);
+        ok = mapped.readBlock(back.data(), back.size() + 1) == expected.size() && back == expected
+             && ok;
+        if (!ok)
+            std::cerr << "file tapes: wrong values read back" << std::endl;
+
+        std::string const sortedPath = path + ".sorted";
+        {
+            std::unique_ptr<external_sort::Tape<int>> in =
+                std::make_unique<external_sort::MmapTape<int>>(path);
+            std::unique_ptr<external_sort::Tape<int>> out =
+                std::make_unique<external_sort::FileTape<int>>(
+                    sortedPath, external_sort::OpenMode::Write, expected.size());
+            std::vector<std::unique_ptr<external_sort::Tape<int>>> tmp;
+            external_sort::SortOptions options;
+            options.memoryBytes = 1024;
+            options.temporaryTapes = 4;
+            external_sort::externalSort<int>(in, out, tmp, options);
+        }
+        external_sort::MmapTape<int> sorted{ sortedPath };
+        std::remove(sortedPath.c_str());
+        std::vector<int> const result(sorted.data(), sorted.data() + sorted.size());
+        if (result != sortedPrefix(expected, expected.size())) {
+            std::cerr << "file tapes: wrong sort output" << std::endl;
+            ok = false;
+        }
+    } catch (std::exception const & e) {
+        std::cerr << "file tapes: " << e.what() << std::endl;
+        ok = false;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Whether the SortStats of a sort of data add up: run formation and the final merge move all
+// of the values and the merge passes as many as they read, the runs only go down, the tapes
+// account for all that the phases read and wrote, and the memory peaked within the budget. Also
+// whether progress went from 0 to the total of every phase, in the order of the phases, without
+// going back and about a hundred times at most.
+bool checkStats(std::string const & name, std::vector<int> const & data,
+                std::vector<std::size_t> const & tapeSizes, external_sort::SortOptions options) {
+    struct Report
+    {
+        std::string phase;
+        std::size_t done;
+        std::size_t total;
+    };
+    external_sort::SortStats stats;
+    std::vector<Report> reports;
+    options.stats = &stats;
+    options.progress = [&reports](external_sort::SortProgress const & progress) {
+        reports.push_back(Report{ progress.phase, progress.done, progress.total });
+    };
+    if (!checkSort(name, data, tapeSizes, options))
+        return false;
+
+    std::size_t const n = data.size();
+    auto const & phases = stats.phases;
+    bool ok = !phases.empty() && phases.front().name == "run formation"
+              && phases.front().valuesRead == n && phases.front().valuesWritten == n
+              && phases.front().runs == stats.runs && stats.naturalRuns <= stats.runs;
+    std::uint64_t comparisons = 0;
+    std::size_t read = 0;
+    std::size_t written = 0;
+    for (std::size_t i = 0; i < phases.size(); ++i) {
+        auto const & phase = phases[i];
+        comparisons += phase.comparisons;
+        read += phase.valuesRead;
+        written += phase.valuesWritten;
+        if (i != 0 && i + 1 != phases.size())
+            ok = ok && phase.name == "merge pass " + std::to_string(i)
+                 && phase.runs < phases[i - 1].runs && phase.valuesRead == phase.valuesWritten
+                 && phase.valuesRead <= n;
+    }
+    if (phases.size() > 1)
+        ok = ok && phases.back().name == "final merge" && phases.back().valuesRead == n
+             && phases.back().valuesWritten == n && phases.back().runs == 1
+             && phases.back().comparisons != 0;
+    ok = ok && comparisons == stats.comparisons && stats.peakMemoryBytes != 0
+         && stats.peakMemoryBytes <= options.memoryBytes;
+
+    auto const & tapes = stats.tapes;
+    ok = ok && tapes.size() == 2 + tapeSizes.size() && tapes[0].name == "input"
+         && tapes[0].valuesRead == n && tapes[0].valuesWritten == 0 && tapes[1].name == "output"
+         && tapes[1].valuesWritten == n && tapes[1].bytesWritten == n * sizeof(int);
+    for (std::size_t i = 0; ok && i < tapes.size(); ++i) {
+        ok = (i < 2 || tapes[i].name == "temporary " + std::to_string(i - 2))
+             && tapes[i].bytesRead == tapes[i].valuesRead * sizeof(int);
+        read -= tapes[i].valuesRead;
+        written -= tapes[i].valuesWritten;
+    }
+    if (!ok || read != 0 || written != 0) {
+        std::cerr << name << ": stats don't add up" << std::endl;
+        return false;
+    }
+
+    std::size_t phase = 0;
+    std::size_t first = 0;
+    for (std::size_t i = 0; ok && i < reports.size(); ++i) {
+        if (i == 0 || reports[i].phase != reports[i - 1].phase) {
+            ok = i == 0 || (reports[i - 1].done == reports[i - 1].total && i - first <= 102);
+            first = i;
+            ok = ok && phase < phases.size() && reports[i].phase == phases[phase++].name
+                 && reports[i].done == 0;
+        } else {
+            ok = reports[i].total == reports[i - 1].total
+                 && reports[i].done >= reports[i - 1].done;
+        }
+        ok = ok && reports[i].done <= reports[i].total;
+    }
+    ok = ok && phase == phases.size() && !reports.empty()
+         && reports.back().done == reports.back().total && reports.size() - first <= 102
+         && reports.front().total == n;
+    if (!ok)
+        std::cerr << name << ": wrong progress" << std::endl;
+    return ok;
+}
+
+bool runChecks(std::mt19937 & rng) {
+    external_sort::SortOptions small;
+    small.memoryBytes = 1024;
+    external_sort::SortOptions pipelined = small;
+    pipelined.threads = 2;
+    external_sort::SortOptions encoded = small;
+    encoded.runCodec = external_sort::RunCodec::Delta;
+    external_sort::SortOptions replacement = small;
+    replacement.runGeneration = external_sort::RunGeneration::ReplacementSelection;
+    external_sort::SortOptions async = small;
+    async.asyncIo = true;
+    external_sort::SortOptions linear = small;
+    linear.mergeStrategy = external_sort::MergeStrategy::LinearScan;
+    // A final merge of 15 runs in 4 key ranges.
+    external_sort::SortOptions parallel;
+    parallel.memoryBytes = 16384;
+    parallel.minBlockBytes = 1024;
+    parallel.threads = 3;
+
+    bool ok = true;
+    // Runs that don't fit on the room left on any single tape.
+    ok = checkSort("1000000 on 4 x 500000", randomValues(1000000, 1000, rng),
+                   { 500000, 500000, 500000, 500000 }, small)
+         && ok;
+    ok = checkSort("999983 on uneven tapes", randomValues(999983, 1 << 30, rng),
+                   { 500003, 499999, 499993, 500011 }, small)
+         && ok;
+    ok = checkSort("5003 on uneven tapes, pipelined", randomValues(5003, 100, rng),
+                   { 1001, 1500, 4002, 3503, 1 }, pipelined)
+         && ok;
+    ok = checkSort("5003 on uneven tapes, encoded", randomValues(5003, 1 << 20, rng),
+                   { 1001, 1500, 4502, 4003, 1 }, encoded)
+         && ok;
+
+    // Every run generation, merge strategy and I/O mode, and deduplication on top of them.
+    std::vector<int> const values = randomValues(20000, 5000, rng);
+    std::vector<std::size_t> const tapes{ 10000, 10000, 10000, 10000 };
+    ok = checkSort("20000, replacement selection", values, tapes, replacement) && ok;
+    ok = checkSort("20000, async I/O", values, tapes, async) && ok;
+    ok = checkSort("20000, linear scan", values, tapes, linear) && ok;
+    ok = checkSort("20000, unique", values, tapes, small, external_sort::Unique{}) && ok;
+    ok = checkSort("20000, unique, pipelined", values, tapes, pipelined, external_sort::Unique{})
+         && ok;
+    ok = checkSort("20000, unique, replacement selection", values, tapes, replacement,
+                   external_sort::Unique{})
+         && ok;
+
+    // Only 8 keys: every splitter of the parallel final merge falls inside a run of equal ones.
+    std::vector<std::size_t> const roomy{ 60000, 60000, 60000, 60000 };
+    ok = checkSort("50000 of 8 keys, parallel final merge", randomValues(50000, 7, rng), roomy,
+                   parallel)
+         && ok;
+    ok = checkSort("50000, parallel final merge", randomValues(50000, 1 << 30, rng), roomy,
+                   parallel)
+         && ok;
+
+    // Sorted and strictly decreasing inputs are read in place, whatever the room on the tapes.
+    std::vector<int> ascending = randomValues(5000, 1000, rng);
+    std::sort(ascending.begin(), ascending.end());
+    std::vector<int> descending(5000);
+    for (std::size_t i = 0; i < descending.size(); ++i)
+        descending[i] = int(descending.size() - i);
+    ok = checkNatural("5000 sorted on 4 x 10", ascending, small) && ok;
+    ok = checkNatural("5000 reversed on 4 x 10", descending, small) && ok;
+    ok = checkNatural("5000 sorted on 4 x 10, pipelined", ascending, pipelined) && ok;
+    ok = checkNatural("5000 reversed on 4 x 10, pipelined", descending, pipelined) && ok;
+
+    // 256 values of memory: a k of 200 stays in the heap, one of 3000 goes through a stream.
+    // Cut to 100 values, the 79 runs need less than half the room of the full ones.
+    ok = checkStream("stream of 20000", values, external_sort::detail::kUnlimited, tapes, small)
+         && ok;
+    ok = checkStream("stream of 20000 limited to 100", values, 100, { 4000, 4000, 4000, 4000 },
+                     small)
+         && ok;
+    ok = checkTopK("top 200 of 20000, heap", values, 200, {}, small) && ok;
+    ok = checkTopK("top 3000 of 20000, stream", values, 3000, tapes, small) && ok;
+
+    // Keys radix sort maps to unsigned ones, and the delta codec on top of those.
+    ok = checkKeys<float>("float", small, rng) && ok;
+    ok = checkKeys<double>("double", small, rng) && ok;
+    ok = checkKeys<std::int8_t>("int8_t", small, rng) && ok;
+    ok = checkKeys<std::int32_t>("int32_t", encoded, rng) && ok;
+    ok = checkKeys<std::int64_t>("int64_t", encoded, rng) && ok;
+    ok = checkKeys<double>("double, encoded", encoded, rng) && ok;
+
+    // About 5000 runs of records merged in several passes, with a fan-in of 3 in one of them.
+    std::vector<std::string> const records = randomRecords(20000, 40, rng);
+    std::vector<std::size_t> const recordTapes(4, 20000 * 44);
+    external_sort::SortOptions narrow = small;
+    narrow.minBlockBytes = 16;
+    narrow.maxFanIn = 3;
+    ok = checkRecords("20000 records", records, recordTapes, small) && ok;
+    ok = checkRecords("20000 records, fan-in of 3", records, recordTapes, narrow) && ok;
+    ok = checkRecords("200 records of up to 500 bytes", randomRecords(200, 500, rng), recordTapes,
+                      small)
+         && ok;
+    ok = checkRecords("1000 empty records", std::vector<std::string>(1000), recordTapes, small)
+         && ok;
+
+    ok = checkFileTapes(rng) && ok;
+
+    // A sorted input is copied to the output during run formation, there are no merges.
+    ok = checkStats("20000, stats", values, tapes, small) && ok;
+    ok = checkStats("20000, stats, pipelined", values, tapes, pipelined) && ok;
+    ok = checkStats("20000, stats, replacement selection", values, tapes, replacement) && ok;
+    ok = checkStats("5000 sorted, stats", ascending, tapes, small) && ok;
+    return ok;
+}
+
+}  // namespace
+
 int main(int, char **) {
     std::size_t const dataSize = 1024ULL * 1024ULL;
     std::vector<int> data;
     data.resize(dataSize);
     std::random_device rd{};
     std::mt19937 rng{ rd() };
+    if (!runChecks(rng))
+        return 1;
+
     std::uniform_int_distribution<int> distr(0, 1000);
     for (std::size_t i = 0; i < data.size(); ++i) {
         data[i] = distr(rng);
@@ -72,10 +629,12 @@ int main(int, char **) {
     auto out = std::make_unique<VectorTape<int>>(dataSize);
 
     constexpr std::size_t kMaxMemorySize = 1024;
-    tmp.reserve(dataSize * sizeof(int) / kMaxMemorySize + 1);
-    for (size_t i = 0; i < tmp.capacity(); ++i) {
+    // Runs are spread over a fixed set of tapes, merge passes ping-pong between their halves.
+    constexpr std::size_t kTmpTapes = 4;
+    tmp.reserve(kTmpTapes);
+    for (size_t i = 0; i < kTmpTapes; ++i) {
         tmp.emplace_back();
-        tmp.back() = std::make_unique<VectorTape<int>>(kMaxMemorySize / sizeof(int));
+        tmp.back() = std::make_unique<VectorTape<int>>(dataSize / 2);
     }
     external_sort::externalSort<int, kMaxMemorySize>(in, out, tmp);
     for (auto d : out->getData()) {
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace external_sort
+{
+
+/*
+ * Memory budget of a sort. The value buffers of the sort are allocated through
+ * BudgetAllocator, which charges them to the budget, so used() is the memory actually held and
+ * going over the limit throws instead of growing past what the process was granted. Safe to
+ * charge from several threads.
+ */
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(std::size_t limit)
+        : limit_{ limit } {}
+
+    MemoryBudget(MemoryBudget const &) = delete;
+    MemoryBudget & operator=(MemoryBudget const &) = delete;
+
+    void charge(std::size_t bytes) {
+        std::size_t used = used_.load(std::memory_order_relaxed);
+        do {
+            if (bytes > limit_ - used)
+                throw std::runtime_error("Memory budget exceeded: " + std::to_string(used) + " + "
+                                         + std::to_string(bytes) + " > "
+                                         + std::to_string(limit_) + " bytes");
+        } while (!used_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+
+        std::size_t peak = peak_.load(std::memory_order_relaxed);
+        while (used + bytes > peak
+               && !peak_.compare_exchange_weak(peak, used + bytes, std::memory_order_relaxed)) {
+        }
+    }
+
+    void release(std::size_t bytes) { used_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    std::size_t limit() const { return limit_; }
+    std::size_t used() const { return used_.load(std::memory_order_relaxed); }
+    std::size_t peak() const { return peak_.load(std::memory_order_relaxed); }
+
+private:
+    std::size_t limit_;
+    std::atomic<std::size_t> used_{ 0 };
+    std::atomic<std::size_t> peak_{ 0 };
+};
+
+// Allocator charging a MemoryBudget, a default constructed one charges nothing.
+template<typename T>
+class BudgetAllocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    BudgetAllocator() = default;
+
+    explicit BudgetAllocator(MemoryBudget * budget)
+        : budget_{ budget } {}
+
+    template<typename U>
+    BudgetAllocator(BudgetAllocator<U> const & other)
+        : budget_{ other.budget() } {}
+
+    T * allocate(std::size_t n) {
+        if (budget_ != nullptr)
+            budget_->charge(n * sizeof(T));
+        try {
+            return std::allocator<T>{}.allocate(n);
+        } catch (...) {
+            if (budget_ != nullptr)
+                budget_->release(n * sizeof(T));
+            throw;
+        }
+    }
+
+    void deallocate(T * p, std::size_t n) {
+        std::allocator<T>{}.deallocate(p, n);
+        if (budget_ != nullptr)
+            budget_->release(n * sizeof(T));
+    }
+
+    MemoryBudget * budget() const { return budget_; }
+
+    template<typename U>
+    bool operator==(BudgetAllocator<U> const & other) const {
+        return budget_ == other.budget();
+    }
+
+    template<typename U>
+    bool operator!=(BudgetAllocator<U> const & other) const {
+        return budget_ != other.budget();
+    }
+
+private:
+    MemoryBudget * budget_ = nullptr;
+};
+
+// Value buffer charged to a budget.
+template<typename T>
+using Buffer = std::vector<T, BudgetAllocator<T>>;
+
+}  // namespace external_sort
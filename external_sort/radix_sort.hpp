@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+namespace external_sort
+{
+namespace detail
+{
+
+template<std::size_t kSize>
+struct UnsignedOfSize;
+
+template<>
+struct UnsignedOfSize<1>
+{
+    using type = std::uint8_t;
+};
+
+template<>
+struct UnsignedOfSize<2>
+{
+    using type = std::uint16_t;
+};
+
+template<>
+struct UnsignedOfSize<4>
+{
+    using type = std::uint32_t;
+};
+
+template<>
+struct UnsignedOfSize<8>
+{
+    using type = std::uint64_t;
+};
+
+template<typename Value>
+constexpr bool kRadixSortable =
+    (std::is_integral<Value>::value && !std::is_same<Value, bool>::value && sizeof(Value) <= 8)
+    || (std::is_floating_point<Value>::value && std::numeric_limits<Value>::is_iec559
+        && (sizeof(Value) == 4 || sizeof(Value) == 8));
+
+/*
+ * Maps a value to an unsigned integer of the same size whose natural order is the order of
+ * operator< on the value: the sign bit of signed integers is flipped, negative floats have all
+ * of their bits flipped and positive ones just the sign bit.
+ */
+template<typename Value>
+auto radixKey(Value value) {
+    using key_type = typename UnsignedOfSize<sizeof(Value)>::type;
+    constexpr key_type kSignBit = key_type(1) << (8 * sizeof(Value) - 1);
+    key_type key;
+    std::memcpy(&key, &value, sizeof(Value));
+    if constexpr (std::is_floating_point<Value>::value)
+        return key_type(key & kSignBit ? ~key : key | kSignBit);
+    else if constexpr (std::is_signed<Value>::value)
+        return key_type(key ^ kSignBit);
+    else
+        return key;
+}
+
+// Inverse of radixKey().
+template<typename Value>
+Value radixValue(typename UnsignedOfSize<sizeof(Value)>::type key) {
+    using key_type = typename UnsignedOfSize<sizeof(Value)>::type;
+    constexpr key_type kSignBit = key_type(1) << (8 * sizeof(Value) - 1);
+    if constexpr (std::is_floating_point<Value>::value)
+        key = key_type(key & kSignBit ? key ^ kSignBit : ~key);
+    else if constexpr (std::is_signed<Value>::value)
+        key = key_type(key ^ kSignBit);
+    Value value;
+    std::memcpy(&value, &key, sizeof(Value));
+    return value;
+}
+
+template<typename Value>
+std::size_t radixDigit(Value const & value, std::size_t byte) {
+    return static_cast<std::size_t>((radixKey(value) >> (8 * byte)) & 0xff);
+}
+
+/*
+ * In-place MSD radix sort (American flag sort) on byte digits starting from the most
+ * significant one. Each level counts the digits, then permutes the values into their buckets
+ * by following cycles, so no scratch buffer is needed and the memory budget of a chunk holds.
+ * Small buckets are left to std::sort on the same keys, so that -0.0 goes before 0.0 and NaNs
+ * go to either end, by their sign, wherever they are; operator< can't place those.
+ */
+template<typename Value>
+void radixSort(Value * first, Value * last, std::size_t byte = sizeof(Value) - 1) {
+    constexpr std::ptrdiff_t kComparisonSortThreshold = 64;
+
+    for (;;) {
+        if (last - first <= kComparisonSortThreshold) {
+            std::sort(first, last, [](Value const & a, Value const & b) {
+                return radixKey(a) < radixKey(b);
+            });
+            return;
+        }
+
+        std::array<std::size_t, 256> counts{};
+        for (Value * p = first; p != last; ++p)
+            ++counts[radixDigit(*p, byte)];
+
+        // All values share this digit: go straight to the next one.
+        if (counts[radixDigit(*first, byte)] == static_cast<std::size_t>(last - first)) {
+            if (byte == 0)
+                return;
+            --byte;
+            continue;
+        }
+
+        std::array<std::size_t, 256> heads;
+        std::array<std::size_t, 256> tails;
+        std::size_t offset = 0;
+        for (std::size_t d = 0; d < 256; ++d) {
+            heads[d] = offset;
+            offset += counts[d];
+            tails[d] = offset;
+        }
+
+        for (std::size_t d = 0; d < 256; ++d) {
+            while (heads[d] < tails[d]) {
+                Value value = std::move(first[heads[d]]);
+                std::size_t digit = radixDigit(value, byte);
+                while (digit != d) {
+                    std::swap(value, first[heads[digit]++]);
+                    digit = radixDigit(value, byte);
+                }
+                first[heads[d]++] = std::move(value);
+            }
+        }
+
+        if (byte == 0)
+            return;
+        std::size_t begin = 0;
+        for (std::size_t d = 0; d < 256; ++d) {
+            if (counts[d] > 1)
+                radixSort(first + begin, first + begin + counts[d], byte - 1);
+            begin += counts[d];
+        }
+        return;
+    }
+}
+
+// Sorts a run formation chunk: radix sort for integral and floating point keys, std::sort
+// for everything else.
+template<typename Value>
+void sortChunk(Value * first, Value * last) {
+    if constexpr (kRadixSortable<Value>)
+        radixSort(first, last);
+    else
+        std::sort(first, last);
+}
+
+}  // namespace detail
+}  // namespace external_sort
@@ -0,0 +1,487 @@
+#pragma once
+
+#include "external_sort.hpp"
+#include "file_tape.hpp"
+#include "loser_tree.hpp"
+#include "memory_budget.hpp"
+#include "tape.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * Variable-length records: strings and blobs are stored on byte tapes (Tape<char>) as a
+ * RecordLength prefix followed by the record bytes. Records are ordered like std::string, i.e.
+ * bytewise as unsigned char, shorter first on a common prefix.
+ */
+
+namespace external_sort
+{
+
+using RecordLength = std::uint32_t;
+
+namespace detail
+{
+
+// Buffered sequential input from [offset, offset + size) of a byte tape.
+class ByteReader
+{
+public:
+    ByteReader(Tape<char> * tape, std::size_t offset, std::size_t size, std::size_t blockSize,
+               MemoryBudget * budget = nullptr)
+        : tape_{ tape }
+        , next_{ offset }
+        , remaining_{ size }
+        , buffer_(std::max<std::size_t>(1, std::min(blockSize, size)),
+                  BudgetAllocator<char>{ budget }) {}
+
+    std::size_t remaining() const { return buffered_ - cursor_ + remaining_; }
+
+    void read(void * dst, std::size_t n) {
+        auto * out = static_cast<char *>(dst);
+        while (n != 0) {
+            if (cursor_ == buffered_)
+                fill();
+            std::size_t const chunk = std::min(n, buffered_ - cursor_);
+            std::memcpy(out, buffer_.data() + cursor_, chunk);
+            cursor_ += chunk;
+            out += chunk;
+            n -= chunk;
+        }
+    }
+
+private:
+    void fill() {
+        if (remaining_ == 0)
+            throw std::runtime_error("Truncated record");
+        tape_->pos(next_);
+        buffered_ = tape_->readBlock(buffer_.data(), std::min(buffer_.size(), remaining_));
+        if (buffered_ == 0)
+            throw std::runtime_error("Unexpected end of tape");
+        cursor_ = 0;
+        next_ += buffered_;
+        remaining_ -= buffered_;
+    }
+
+    Tape<char> * tape_;
+    std::size_t next_;
+    std::size_t remaining_;
+    Buffer<char> buffer_;
+    std::size_t cursor_ = 0;
+    std::size_t buffered_ = 0;
+};
+
+// Buffered sequential output to a byte tape starting at offset.
+class ByteWriter
+{
+public:
+    ByteWriter(Tape<char> * tape, std::size_t offset, std::size_t blockSize,
+               MemoryBudget * budget = nullptr)
+        : tape_{ tape }
+        , next_{ offset }
+        , buffer_(BudgetAllocator<char>{ budget }) {
+        buffer_.reserve(std::max<std::size_t>(1, blockSize));
+    }
+
+    void write(void const * data, std::size_t n) {
+        auto const * in = static_cast<char const *>(data);
+        while (n != 0) {
+            std::size_t const chunk = std::min(n, buffer_.capacity() - buffer_.size());
+            buffer_.insert(buffer_.end(), in, in + chunk);
+            in += chunk;
+            n -= chunk;
+            if (buffer_.size() == buffer_.capacity())
+                flushBlock();
+        }
+    }
+
+    void finish() {
+        flushBlock();
+        tape_->flush();
+    }
+
+    std::size_t written() const { return next_ + buffer_.size(); }
+
+private:
+    void flushBlock() {
+        if (buffer_.empty())
+            return;
+        tape_->pos(next_);
+        tape_->writeBlock(buffer_.data(), buffer_.size());
+        next_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    Tape<char> * tape_;
+    std::size_t next_;
+    Buffer<char> buffer_;
+};
+
+/*
+ * Normalized key prefix: the first eight bytes of the record, big endian and zero padded. Two
+ * records with different prefixes compare like their prefixes, so the full comparison is only
+ * needed when the prefixes are equal.
+ */
+inline std::uint64_t keyPrefix(std::string_view record) {
+    std::uint64_t prefix = 0;
+    std::size_t const n = std::min<std::size_t>(record.size(), 8);
+    for (std::size_t i = 0; i < n; ++i)
+        prefix |= std::uint64_t(static_cast<unsigned char>(record[i])) << (56 - 8 * i);
+    return prefix;
+}
+
+// A record of the in-memory chunk: its key prefix and where its bytes are in the arena.
+struct RecordRef
+{
+    std::uint64_t prefix;
+    std::size_t offset;
+    std::size_t length;
+};
+
+/*
+ * Memory for run formation, allocated once: record bytes are appended at the front of the arena
+ * and RecordRefs grow down from its end, so the chunk is full exactly when the two meet and the
+ * accounting is in actual bytes.
+ */
+class RecordChunk
+{
+public:
+    RecordChunk(std::size_t bytes, MemoryBudget * budget)
+        : arena_(bytes / alignof(RecordRef) * alignof(RecordRef),
+                 BudgetAllocator<char>{ budget }) {}
+
+    bool fits(std::size_t length) const {
+        return used_ + length + (count_ + 1) * sizeof(RecordRef) <= arena_.size();
+    }
+
+    // Reserves room for a record of length bytes and returns where to put them; fits() first.
+    char * add(std::size_t length) {
+        char * bytes = arena_.data() + used_;
+        new (refs() - 1) RecordRef{ 0, used_, length };
+        used_ += length;
+        ++count_;
+        return bytes;
+    }
+
+    void sort() {
+        RecordRef * first = refs();
+        RecordRef * last = first + count_;
+        for (RecordRef * ref = first; ref != last; ++ref)
+            ref->prefix = keyPrefix(record(*ref));
+        std::sort(first, last, [this](RecordRef const & a, RecordRef const & b) {
+            if (a.prefix != b.prefix)
+                return a.prefix < b.prefix;
+            return record(a) < record(b);
+        });
+    }
+
+    template<typename F>
+    void forEach(F && f) const {
+        RecordRef const * first = refs();
+        for (std::size_t i = 0; i < count_; ++i)
+            f(record(first[i]));
+    }
+
+    std::size_t count() const { return count_; }
+
+    // Bytes the records take on a tape, length prefixes included.
+    std::size_t encodedSize() const { return used_ + count_ * sizeof(RecordLength); }
+
+    void clear() {
+        used_ = 0;
+        count_ = 0;
+    }
+
+private:
+    RecordRef * refs() {
+        return reinterpret_cast<RecordRef *>(arena_.data() + arena_.size()) - count_;
+    }
+
+    RecordRef const * refs() const {
+        return reinterpret_cast<RecordRef const *>(arena_.data() + arena_.size()) - count_;
+    }
+
+    std::string_view record(RecordRef const & ref) const {
+        return std::string_view{ arena_.data() + ref.offset, ref.length };
+    }
+
+    Buffer<char> arena_;
+    std::size_t used_ = 0;
+    std::size_t count_ = 0;
+};
+
+}  // namespace detail
+
+/*
+ * Sequential reader of the records in [offset, offset + size) of a byte tape. The current record
+ * is copied out of the block buffer, into a buffer that is only reallocated, to exactly its
+ * length, when a longer record comes; both are charged to budget if there is one.
+ */
+class RecordReader
+{
+public:
+    static constexpr std::size_t kDefaultBlockSize = 64 * 1024;
+
+    RecordReader(Tape<char> * tape, std::size_t offset, std::size_t size,
+                 std::size_t blockSize = kDefaultBlockSize, MemoryBudget * budget = nullptr)
+        : bytes_{ tape, offset, size, blockSize, budget }
+        , record_(BudgetAllocator<char>{ budget }) {
+        next();
+    }
+
+    bool empty() const { return empty_; }
+
+    std::string_view head() const { return std::string_view{ record_.data(), record_.size() }; }
+
+    std::uint64_t prefix() const { return prefix_; }
+
+    void next() {
+        if (bytes_.remaining() == 0) {
+            empty_ = true;
+            return;
+        }
+        RecordLength length;
+        bytes_.read(&length, sizeof(length));
+        if (length > record_.capacity()) {
+            // Freed first, so the longest record is held once rather than next to the last one.
+            record_ = Buffer<char>(record_.get_allocator());
+            record_.reserve(length);
+        }
+        record_.resize(length);
+        bytes_.read(record_.data(), length);
+        prefix_ = detail::keyPrefix(head());
+    }
+
+private:
+    detail::ByteReader bytes_;
+    Buffer<char> record_;
+    std::uint64_t prefix_ = 0;
+    bool empty_ = false;
+};
+
+// Sequential writer of records to a byte tape starting at offset.
+class RecordWriter
+{
+public:
+    static constexpr std::size_t kDefaultBlockSize = 64 * 1024;
+
+    RecordWriter(Tape<char> * tape, std::size_t offset = 0,
+                 std::size_t blockSize = kDefaultBlockSize, MemoryBudget * budget = nullptr)
+        : bytes_{ tape, offset, blockSize, budget } {}
+
+    void push(std::string_view record) {
+        if (record.size() > std::numeric_limits<RecordLength>::max())
+            throw std::length_error("Record too long");
+        RecordLength const length = static_cast<RecordLength>(record.size());
+        bytes_.write(&length, sizeof(length));
+        bytes_.write(record.data(), record.size());
+    }
+
+    void finish() { bytes_.finish(); }
+
+    // Tape position right after the last record pushed.
+    std::size_t end() const { return bytes_.written(); }
+
+private:
+    detail::ByteWriter bytes_;
+};
+
+namespace detail
+{
+
+/*
+ * Forms the runs from chunks of chunkBytes and returns the length of the longest record. Records
+ * longer than maxLength are refused up front, before a merge would run out of memory for them.
+ */
+inline std::size_t formRecordRuns(Tape<char> * in, TapeGroup<char> & tapes,
+                                  std::size_t chunkBytes, std::size_t blockSize,
+                                  std::size_t maxLength, MemoryBudget & budget,
+                                  std::vector<Run<char>> & runs) {
+    ByteReader reader{ in, 0, in->size(), blockSize, &budget };
+    RecordChunk chunk{ chunkBytes, &budget };
+    bool pending = false;
+    RecordLength length = 0;
+    std::size_t longest = 0;
+
+    while (pending || reader.remaining() != 0) {
+        for (;;) {
+            if (!pending) {
+                if (reader.remaining() == 0)
+                    break;
+                reader.read(&length, sizeof(length));
+                pending = true;
+            }
+            if (length > maxLength || !chunk.fits(length)) {
+                if (length > maxLength || chunk.count() == 0)
+                    throw std::runtime_error("Record of " + std::to_string(length)
+                                             + " bytes doesn't fit in memory");
+                break;
+            }
+            reader.read(chunk.add(length), length);
+            longest = std::max<std::size_t>(longest, length);
+            pending = false;
+        }
+
+        chunk.sort();
+        runs.push_back(tapes.allocate(chunk.encodedSize()));
+        RecordWriter writer{ runs.back().tape, runs.back().offset, blockSize, &budget };
+        chunk.forEach([&writer](std::string_view record) { writer.push(record); });
+        writer.finish();
+        chunk.clear();
+    }
+    return longest;
+}
+
+// Records a merge needs at the least: two runs, a copy of the longest record of each, and a
+// byte for every block.
+inline std::size_t maxRecordLength(std::size_t memoryBytes) {
+    return memoryBytes > 3 ? (memoryBytes - 3) / 2 : 0;
+}
+
+// The fan-in that leaves every run and the output a block of at least minBlock bytes next to
+// a copy of the longest record of every run, capped by fanIn and never below 2.
+inline std::size_t recordFanIn(std::size_t memoryBytes, std::size_t longest, std::size_t minBlock,
+                               std::size_t fanIn) {
+    minBlock = std::max<std::size_t>(1, minBlock);
+    std::size_t const fits =
+        memoryBytes > minBlock ? (memoryBytes - minBlock) / (longest + minBlock) : 0;
+    return std::max<std::size_t>(2, std::min(fanIn, fits));
+}
+
+// Orders loser tree entries by the key prefix first and the full record on a tie.
+struct RecordKey
+{
+    std::uint64_t prefix = 0;
+    RecordReader const * reader = nullptr;
+};
+
+struct RecordKeyLess
+{
+    bool operator()(RecordKey const & a, RecordKey const & b) const {
+        if (a.prefix != b.prefix)
+            return a.prefix < b.prefix;
+        return a.reader->head() < b.reader->head();
+    }
+};
+
+// Merges runs into target. Every reader holds a copy of its current record, up to longest
+// bytes, so that much per run comes off memoryBytes before it is split into blocks.
+inline void mergeRecords(std::vector<Run<char>> const & runs, Run<char> const & target,
+                         std::size_t memoryBytes, std::size_t longest, MemoryBudget & budget) {
+    std::size_t const records = runs.size() * longest;
+    if (records + runs.size() + 1 > memoryBytes)
+        throw std::runtime_error("Insufficient memory to merge " + std::to_string(runs.size())
+                                 + " runs of records up to " + std::to_string(longest)
+                                 + " bytes long");
+    std::size_t const blockSize = (memoryBytes - records) / (runs.size() + 1);
+
+    std::vector<RecordReader> readers;
+    readers.reserve(runs.size());
+    for (auto const & run : runs)
+        readers.emplace_back(run.tape, run.offset, run.size, blockSize, &budget);
+
+    LoserTree<RecordKey, RecordKeyLess> tree{ readers.size() };
+    for (std::size_t i = 0; i < readers.size(); ++i) {
+        if (!readers[i].empty())
+            tree.set(i, RecordKey{ readers[i].prefix(), &readers[i] });
+    }
+    tree.build();
+
+    RecordWriter writer{ target.tape, target.offset, blockSize, &budget };
+    while (!tree.empty()) {
+        auto & reader = readers[tree.top()];
+        writer.push(reader.head());
+        reader.next();
+        if (reader.empty())
+            tree.popTop();
+        else
+            tree.replaceTop(RecordKey{ reader.prefix(), &reader });
+    }
+    writer.finish();
+    if (writer.end() != target.offset + target.size)
+        throw std::runtime_error("Merged " + std::to_string(writer.end() - target.offset)
+                                 + " bytes instead of " + std::to_string(target.size));
+}
+
+}  // namespace detail
+
+/*
+ * Sorts the length-prefixed records of a byte tape. The memory budget is accounted in actual
+ * bytes, and every buffer is charged to a MemoryBudget of options.memoryBytes: run formation
+ * packs records and their 24 byte sort entries into a single arena next to the input and output
+ * blocks; a merge holds a copy of the current record of every run, up to the longest record, and
+ * splits the rest into one block per run and the output. Records longer than about half of the
+ * memory are refused. Runs are formed from chunks and merged with the loser tree, in as many
+ * passes as maxFanIn, minBlockBytes and the longest record call for. Without temporary tapes,
+ * options.temporaryTapes anonymous files are created in options.temporaryDirectory; the other
+ * options don't apply.
+ */
+template<typename TapePtr = Tape<char> *, typename TapesContainer = std::vector<TapePtr>>
+void externalSortRecords(TapePtr && in, TapePtr && out, TapesContainer & tmp,
+                         SortOptions const & options = SortOptions{}) {
+    if (tmp.empty() && options.temporaryTapes != 0) {
+        auto files = makeTemporaryTapes<char>(options.temporaryTapes,
+                                              options.temporaryDirectory.empty()
+                                                  ? defaultTemporaryDirectory()
+                                                  : options.temporaryDirectory);
+        externalSortRecords(std::forward<TapePtr>(in), std::forward<TapePtr>(out), files,
+                            options);
+        return;
+    }
+
+    std::size_t const inputSize = in->size();
+    std::size_t const memoryBytes = options.memoryBytes;
+    // An eighth of the memory goes to the input and output blocks, the rest to the arena.
+    std::size_t const blockSize = std::max<std::size_t>(1, memoryBytes / 16);
+    std::size_t const chunkBytes = memoryBytes > 2 * blockSize ? memoryBytes - 2 * blockSize : 0;
+
+    if (chunkBytes < sizeof(detail::RecordRef))
+        throw std::runtime_error("Insufficient memory");
+
+    // Record runs are never encoded, so they don't need room for a decoded block.
+    SortOptions mergeOptions = options;
+    mergeOptions.runCodec = RunCodec::None;
+    std::size_t fanIn = detail::fanIn<char>(memoryBytes, mergeOptions);
+    // Every record takes at least its length prefix and a sort entry on top of its bytes, so
+    // this estimate errs on the side of more runs.
+    std::size_t const expectedRuns = (inputSize + chunkBytes / 2 - 1) / (chunkBytes / 2);
+    detail::TapeGroup<char> first;
+    detail::TapeGroup<char> second;
+    detail::splitTapes(tmp, expectedRuns > fanIn, inputSize, false, first, second);
+
+    MemoryBudget budget{ memoryBytes };
+    std::vector<detail::Run<char>> runs;
+    std::size_t const longest =
+        detail::formRecordRuns(detail::rawTape(in), first, chunkBytes, blockSize,
+                               detail::maxRecordLength(memoryBytes), budget, runs);
+    fanIn = detail::recordFanIn(memoryBytes, longest, options.minBlockBytes, fanIn);
+    runs = detail::mergePasses(std::move(runs), first, second, fanIn,
+                               [](auto & tapes, std::size_t size) { return tapes.allocate(size); },
+                               [memoryBytes, longest, &budget](auto const & group,
+                                                               auto const & target) {
+                                   detail::mergeRecords(group, target, memoryBytes, longest,
+                                                        budget);
+                                   return target.size;
+                               });
+    detail::mergeRecords(runs, detail::Run<char>{ detail::rawTape(out), 0, inputSize, inputSize },
+                         memoryBytes, longest, budget);
+}
+
+// Compile-time memory budget, overrides options.memoryBytes.
+template<std::size_t kMaxMemorySize, typename TapePtr = Tape<char> *,
+         typename TapesContainer = std::vector<TapePtr>>
+void externalSortRecords(TapePtr && in, TapePtr && out, TapesContainer & tmp,
+                         SortOptions options = SortOptions{}) {
+    options.memoryBytes = kMaxMemorySize;
+    externalSortRecords(std::forward<TapePtr>(in), std::forward<TapePtr>(out), tmp, options);
+}
+
+}  // namespace external_sort
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "radix_sort.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+namespace external_sort
+{
+namespace detail
+{
+
+/*
+ * Block codec for sorted runs. A block is a header of two uint32, the number of values and the
+ * payload size in bytes, followed by the payload, padded to whole values so blocks can live on a
+ * Tape<Value>. The payload is the LEB128 varint of the difference between the radix keys of
+ * consecutive values, the first one against zero, which takes a byte or two per value on a
+ * sorted run of random 64 bit keys. A block that wouldn't get smaller is stored raw, which the
+ * payload size tells apart, so an encoded run never takes more than a header per block on top
+ * of its raw size. Only radix sortable values are delta coded, all others are always raw.
+ */
+template<typename Value>
+class DeltaCodec
+{
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "DeltaCodec copies values as raw bytes");
+
+public:
+    static constexpr std::size_t kHeaderBytes = 2 * sizeof(std::uint32_t);
+    static constexpr std::size_t kHeaderSlots = (kHeaderBytes + sizeof(Value) - 1) / sizeof(Value);
+
+    // Tape positions taken by one encoded block of count values at most.
+    static std::size_t blockBound(std::size_t count) { return kHeaderSlots + count; }
+
+    // Tape positions taken by count values encoded in blocks of blockSize values at most.
+    static std::size_t extentBound(std::size_t count, std::size_t blockSize) {
+        return count + (count + blockSize - 1) / blockSize * kHeaderSlots;
+    }
+
+    // Encodes a block into out, which has room for blockBound(count) values, and returns the
+    // number of values of out it took.
+    static std::size_t encode(Value const * values, std::size_t count, Value * out) {
+        auto * header = reinterpret_cast<unsigned char *>(out);
+        unsigned char * const payload = header + kHeaderSlots * sizeof(Value);
+        std::size_t const rawBytes = count * sizeof(Value);
+        std::size_t bytes = rawBytes;
+        if constexpr (kRadixSortable<Value>) {
+            bytes = encodeDeltas(values, count, payload, rawBytes);
+        }
+        if (bytes == rawBytes)
+            std::memcpy(payload, values, rawBytes);
+        writeHeader(header, count, bytes);
+        return kHeaderSlots + slots(bytes);
+    }
+
+    // Reads the header of the block at in: its value count and the tape positions it takes.
+    static void header(Value const * in, std::size_t & count, std::size_t & extent) {
+        std::uint32_t fields[2];
+        std::memcpy(fields, in, kHeaderBytes);
+        count = fields[0];
+        extent = kHeaderSlots + slots(fields[1]);
+    }
+
+    // Decodes the block at in, header() tells how many values it holds.
+    static void decode(Value const * in, Value * out) {
+        std::uint32_t fields[2];
+        std::memcpy(fields, in, kHeaderBytes);
+        auto const * payload = reinterpret_cast<unsigned char const *>(in + kHeaderSlots);
+        std::size_t const count = fields[0];
+        std::size_t const bytes = fields[1];
+        if (bytes == count * sizeof(Value)) {
+            std::memcpy(out, payload, bytes);
+            return;
+        }
+        if constexpr (kRadixSortable<Value>) {
+            decodeDeltas(payload, bytes, out, count);
+        } else {
+            throw std::runtime_error("Corrupt run block");
+        }
+    }
+
+private:
+    static std::size_t slots(std::size_t bytes) {
+        return (bytes + sizeof(Value) - 1) / sizeof(Value);
+    }
+
+    static void writeHeader(unsigned char * header, std::size_t count, std::size_t bytes) {
+        std::uint32_t const fields[2] = { static_cast<std::uint32_t>(count),
+                                          static_cast<std::uint32_t>(bytes) };
+        std::memcpy(header, fields, kHeaderBytes);
+        // Keep the padding deterministic.
+        std::memset(header + kHeaderBytes, 0, kHeaderSlots * sizeof(Value) - kHeaderBytes);
+        std::size_t const padded = slots(bytes) * sizeof(Value);
+        std::memset(header + kHeaderSlots * sizeof(Value) + bytes, 0, padded - bytes);
+    }
+
+    // Returns the payload size, or rawBytes when the deltas don't fit in less.
+    static std::size_t encodeDeltas(Value const * values, std::size_t count, unsigned char * out,
+                                    std::size_t rawBytes) {
+        using key_type = typename UnsignedOfSize<sizeof(Value)>::type;
+        unsigned char * const limit = out + rawBytes - 1;
+        unsigned char * p = out;
+        key_type previous = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            key_type const key = radixKey(values[i]);
+            std::uint64_t delta = key_type(key - previous);
+            previous = key;
+            for (;;) {
+                if (p == limit)
+                    return rawBytes;
+                if (delta < 0x80)
+                    break;
+                *p++ = static_cast<unsigned char>(delta | 0x80);
+                delta >>= 7;
+            }
+            *p++ = static_cast<unsigned char>(delta);
+        }
+        return std::size_t(p - out);
+    }
+
+    static void decodeDeltas(unsigned char const * in, std::size_t bytes, Value * out,
+                             std::size_t count) {
+        using key_type = typename UnsignedOfSize<sizeof(Value)>::type;
+        unsigned char const * const end = in + bytes;
+        key_type previous = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            std::uint64_t delta = 0;
+            for (unsigned shift = 0;; shift += 7) {
+                if (in == end)
+                    throw std::runtime_error("Corrupt run block");
+                unsigned char const byte = *in++;
+                delta |= std::uint64_t(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                    break;
+            }
+            previous = key_type(previous + delta);
+            out[i] = radixValue<Value>(previous);
+        }
+    }
+};
+
+}  // namespace detail
+}  // namespace external_sort
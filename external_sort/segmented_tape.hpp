@@ -0,0 +1,117 @@
+#pragma once
+
+#include "tape.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace external_sort
+{
+namespace detail
+{
+
+/*
+ * Tape made of regions of other tapes, one after the other, for a run that doesn't fit on any
+ * single one of them. Positions [0, capacity()) map to the segments in order, and bulk
+ * transfers are split where a segment ends.
+ */
+template<typename Value>
+class SegmentedTape : public Tape<Value>
+{
+public:
+    using value_type = Value;
+
+    struct Segment
+    {
+        Tape<Value> * tape;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    void append(Tape<Value> * tape, std::size_t offset, std::size_t size) {
+        segments_.push_back(Segment{ tape, offset, size });
+    }
+
+    std::vector<Segment> & segments() { return segments_; }
+
+    std::size_t pos() const override { return cursor_; }
+    void pos(std::size_t idx) override { cursor_ = idx; }
+
+    value_type read() const override {
+        auto const [segment, offset] = locate(cursor_);
+        if (segment == segments_.size())
+            throw std::runtime_error("Read out of segmented tape bounds");
+        segments_[segment].tape->pos(segments_[segment].offset + offset);
+        return segments_[segment].tape->read();
+    }
+
+    std::size_t size() const override { return capacity(); }
+
+    std::size_t capacity() const override {
+        std::size_t result = 0;
+        for (auto const & segment : segments_)
+            result += segment.size;
+        return result;
+    }
+
+    void write(value_type value) override {
+        auto const [segment, offset] = locate(cursor_);
+        if (segment == segments_.size())
+            throw std::runtime_error("Can't write beyond end of segmented tape");
+        segments_[segment].tape->pos(segments_[segment].offset + offset);
+        segments_[segment].tape->write(value);
+    }
+
+    void flush() override {
+        for (auto const & segment : segments_)
+            segment.tape->flush();
+    }
+
+    std::size_t readBlock(value_type * buffer, std::size_t count) override {
+        auto [segment, offset] = locate(cursor_);
+        std::size_t done = 0;
+        for (; done < count && segment < segments_.size(); ++segment, offset = 0) {
+            Segment const & s = segments_[segment];
+            std::size_t const n = std::min(count - done, s.size - offset);
+            s.tape->pos(s.offset + offset);
+            std::size_t const got = s.tape->readBlock(buffer + done, n);
+            done += got;
+            if (got != n)
+                break;
+        }
+        cursor_ += done;
+        return done;
+    }
+
+    void writeBlock(value_type const * data, std::size_t count) override {
+        auto [segment, offset] = locate(cursor_);
+        std::size_t done = 0;
+        for (; done < count && segment < segments_.size(); ++segment, offset = 0) {
+            Segment const & s = segments_[segment];
+            std::size_t const n = std::min(count - done, s.size - offset);
+            s.tape->pos(s.offset + offset);
+            s.tape->writeBlock(data + done, n);
+            done += n;
+        }
+        if (done != count)
+            throw std::runtime_error("Can't write beyond end of segmented tape");
+        cursor_ += done;
+    }
+
+private:
+    // Segment holding position idx and the offset of idx in it, segments_.size() past the end.
+    std::pair<std::size_t, std::size_t> locate(std::size_t idx) const {
+        std::size_t segment = 0;
+        while (segment < segments_.size() && idx >= segments_[segment].size)
+            idx -= segments_[segment++].size;
+        return { segment, idx };
+    }
+
+    std::vector<Segment> segments_;
+    std::size_t cursor_ = 0;
+};
+
+}  // namespace detail
+}  // namespace external_sort
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "tape.hpp"
+
+#include <mutex>
+
+namespace external_sort
+{
+namespace detail
+{
+
+/*
+ * Handle on a tape shared between threads. Every handle keeps its own cursor; each access locks
+ * the shared mutex, moves the tape to the cursor and forwards, so a pos() followed by a
+ * readBlock() can't be interleaved with another thread's.
+ */
+template<typename Value>
+class SharedTape : public Tape<Value>
+{
+public:
+    using value_type = Value;
+
+    SharedTape(Tape<Value> * tape, std::mutex * mutex)
+        : tape_{ tape }
+        , mutex_{ mutex } {}
+
+    std::size_t pos() const override { return cursor_; }
+    void pos(std::size_t idx) override { cursor_ = idx; }
+
+    value_type read() const override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        tape_->pos(cursor_);
+        return tape_->read();
+    }
+
+    std::size_t size() const override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        return tape_->size();
+    }
+
+    std::size_t capacity() const override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        return tape_->capacity();
+    }
+
+    void write(value_type value) override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        tape_->pos(cursor_);
+        tape_->write(value);
+    }
+
+    void flush() override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        tape_->flush();
+    }
+
+    std::size_t readBlock(value_type * buffer, std::size_t count) override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        tape_->pos(cursor_);
+        std::size_t const n = tape_->readBlock(buffer, count);
+        cursor_ += n;
+        return n;
+    }
+
+    void writeBlock(value_type const * data, std::size_t count) override {
+        std::lock_guard<std::mutex> lock{ *mutex_ };
+        tape_->pos(cursor_);
+        tape_->writeBlock(data, count);
+        cursor_ += count;
+    }
+
+private:
+    Tape<Value> * tape_;
+    std::mutex * mutex_;
+    std::size_t cursor_ = 0;
+};
+
+}  // namespace detail
+}  // namespace external_sort
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "tape.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace external_sort
+{
+
+// One phase of a sort: run formation, a merge pass or the final merge.
+struct PhaseStats
+{
+    std::string name;
+    double wallSeconds = 0;
+    // Process CPU time, summed over all threads.
+    double cpuSeconds = 0;
+    std::size_t valuesRead = 0;
+    std::size_t valuesWritten = 0;
+    // Runs left once the phase is done.
+    std::size_t runs = 0;
+    std::uint64_t comparisons = 0;
+};
+
+struct TapeStats
+{
+    // "input", "output" or "temporary N".
+    std::string name;
+    std::size_t valuesRead = 0;
+    std::size_t valuesWritten = 0;
+    std::size_t bytesRead = 0;
+    std::size_t bytesWritten = 0;
+    // Calls into the tape.
+    std::size_t reads = 0;
+    std::size_t writes = 0;
+};
+
+struct SortStats
+{
+    std::vector<PhaseStats> phases;
+    std::vector<TapeStats> tapes;
+    double wallSeconds = 0;
+    double cpuSeconds = 0;
+    // Runs formed, natural ones included.
+    std::size_t runs = 0;
+    std::size_t naturalRuns = 0;
+    // Comparisons of the merges, chunks are mostly radix sorted.
+    std::uint64_t comparisons = 0;
+    std::size_t peakMemoryBytes = 0;
+};
+
+struct SortProgress
+{
+    std::string const & phase;
+    std::size_t done;
+    std::size_t total;
+};
+
+namespace detail
+{
+
+/*
+ * Collects the stats of a sort and reports its progress. A phase counts what goes through the
+ * tapes while it runs, through CountingTape; run formation progresses with the values read, the
+ * merges with the values written. Progress is reported when a phase starts, every hundredth of
+ * it and when it ends, never concurrently, but possibly from a worker thread. A monitor with
+ * neither stats nor a progress callback does nothing.
+ */
+class SortMonitor
+{
+public:
+    using ProgressFn = std::function<void(SortProgress const &)>;
+
+    SortMonitor(SortStats * stats, ProgressFn const & progress)
+        : stats_{ stats }
+        , progress_{ progress }
+        , wallStart_{ std::chrono::steady_clock::now() }
+        , cpuStart_{ std::clock() } {
+        if (stats_ != nullptr)
+            *stats_ = SortStats{};
+    }
+
+    bool enabled() const { return stats_ != nullptr || progress_; }
+
+    void beginPhase(std::string name, std::size_t total, bool byWrites) {
+        if (!enabled())
+            return;
+        phase_ = PhaseStats{};
+        phase_.name = std::move(name);
+        total_ = total;
+        byWrites_ = byWrites;
+        read_ = 0;
+        written_ = 0;
+        comparisons_ = 0;
+        reported_ = 0;
+        phaseWall_ = std::chrono::steady_clock::now();
+        phaseCpu_ = std::clock();
+        report(0);
+    }
+
+    void endPhase(std::size_t runs) {
+        if (!enabled())
+            return;
+        phase_.wallSeconds = secondsSince(phaseWall_);
+        phase_.cpuSeconds = cpuSecondsSince(phaseCpu_);
+        phase_.valuesRead = read_;
+        phase_.valuesWritten = written_;
+        phase_.runs = runs;
+        phase_.comparisons = comparisons_;
+        if (stats_ != nullptr) {
+            stats_->phases.push_back(phase_);
+            stats_->comparisons += phase_.comparisons;
+        }
+        report(total_);
+    }
+
+    void formed(std::size_t runs, std::size_t naturalRuns) {
+        if (stats_ == nullptr)
+            return;
+        stats_->runs = runs;
+        stats_->naturalRuns = naturalRuns;
+    }
+
+    void read(std::size_t values) {
+        std::size_t const done = read_.fetch_add(values, std::memory_order_relaxed) + values;
+        if (!byWrites_)
+            progress(done);
+    }
+
+    void wrote(std::size_t values) {
+        std::size_t const done = written_.fetch_add(values, std::memory_order_relaxed) + values;
+        if (byWrites_)
+            progress(done);
+    }
+
+    void compared(std::uint64_t comparisons) {
+        comparisons_.fetch_add(comparisons, std::memory_order_relaxed);
+    }
+
+    void finish(std::vector<TapeStats> tapes, std::size_t peakMemoryBytes) {
+        if (stats_ == nullptr)
+            return;
+        stats_->tapes = std::move(tapes);
+        stats_->wallSeconds = secondsSince(wallStart_);
+        stats_->cpuSeconds = cpuSecondsSince(cpuStart_);
+        stats_->peakMemoryBytes = peakMemoryBytes;
+    }
+
+private:
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static double cpuSecondsSince(std::clock_t start) {
+        return double(std::clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    void progress(std::size_t done) {
+        std::size_t const reported = reported_.load(std::memory_order_relaxed);
+        if (progress_ && done > reported && done - reported > total_ / 100)
+            report(std::min(done, total_));
+    }
+
+    void report(std::size_t done) {
+        if (!progress_)
+            return;
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        reported_.store(done, std::memory_order_relaxed);
+        progress_(SortProgress{ phase_.name, done, total_ });
+    }
+
+    SortStats * stats_;
+    ProgressFn progress_;
+    std::chrono::steady_clock::time_point wallStart_;
+    std::clock_t cpuStart_;
+    PhaseStats phase_;
+    std::size_t total_ = 0;
+    bool byWrites_ = false;
+    std::atomic<std::size_t> read_{ 0 };
+    std::atomic<std::size_t> written_{ 0 };
+    std::atomic<std::uint64_t> comparisons_{ 0 };
+    std::atomic<std::size_t> reported_{ 0 };
+    std::chrono::steady_clock::time_point phaseWall_;
+    std::clock_t phaseCpu_ = 0;
+    std::mutex mutex_;
+};
+
+// Tape counting the values that go through it into its TapeStats and a SortMonitor.
+template<typename Value>
+class CountingTape : public Tape<Value>
+{
+public:
+    using value_type = Value;
+
+    CountingTape(Tape<Value> * tape, std::string name, SortMonitor * monitor)
+        : tape_{ tape }
+        , monitor_{ monitor } {
+        stats_.name = std::move(name);
+    }
+
+    std::size_t pos() const override { return tape_->pos(); }
+    void pos(std::size_t idx) override { tape_->pos(idx); }
+
+    value_type read() const override {
+        value_type value = tape_->read();
+        countRead(1);
+        return value;
+    }
+
+    std::size_t size() const override { return tape_->size(); }
+    std::size_t capacity() const override { return tape_->capacity(); }
+
+    void write(value_type value) override {
+        tape_->write(std::move(value));
+        countWrite(1);
+    }
+
+    void flush() override { tape_->flush(); }
+
+    std::size_t readBlock(value_type * buffer, std::size_t count) override {
+        std::size_t const n = tape_->readBlock(buffer, count);
+        countRead(n);
+        return n;
+    }
+
+    void writeBlock(value_type const * data, std::size_t count) override {
+        tape_->writeBlock(data, count);
+        countWrite(count);
+    }
+
+    TapeStats const & stats() const { return stats_; }
+
+private:
+    void countRead(std::size_t n) const {
+        stats_.valuesRead += n;
+        stats_.bytesRead += n * sizeof(Value);
+        ++stats_.reads;
+        monitor_->read(n);
+    }
+
+    void countWrite(std::size_t n) {
+        stats_.valuesWritten += n;
+        stats_.bytesWritten += n * sizeof(Value);
+        ++stats_.writes;
+        monitor_->wrote(n);
+    }
+
+    Tape<Value> * tape_;
+    SortMonitor * monitor_;
+    mutable TapeStats stats_;
+};
+
+}  // namespace detail
+}  // namespace external_sort
@@ -0,0 +1,245 @@
+#pragma once
+
+#include "external_sort.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace external_sort
+{
+
+/*
+ * Pull-based sort: runs are formed and merged down to a single last pass when the stream is
+ * constructed, the last merge happens as values are pulled, so nothing is written to an output
+ * tape and a consumer that stops early never pays for the rest of it. The last merge gives all
+ * of the memory budget to the run buffers; it always uses the loser tree on the calling thread,
+ * options.threads and options.asyncIo only apply to the passes before it. With a limit only the
+ * first limit values are produced, and no run keeps more than that on the temporary tapes.
+ * A combiner works as for externalSort(), the stream then produces one value per key. The input
+ * and temporary tapes must outlive the stream; when none are passed in, the stream owns the
+ * ones it creates.
+ */
+template<typename Value, typename Combine = detail::NoCombine>
+class SortedStream
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value const *;
+        using reference = Value const &;
+
+        iterator() = default;
+
+        explicit iterator(SortedStream * stream)
+            : stream_{ stream } {}
+
+        reference operator*() const { return stream_->head(); }
+        pointer operator->() const { return &stream_->head(); }
+
+        iterator & operator++() {
+            stream_->next();
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator result = *this;
+            stream_->next();
+            return result;
+        }
+
+        bool operator==(iterator const & other) const {
+            return atEnd() == other.atEnd() && (atEnd() || stream_ == other.stream_);
+        }
+
+        bool operator!=(iterator const & other) const { return !(*this == other); }
+
+    private:
+        bool atEnd() const { return stream_ == nullptr || stream_->empty(); }
+
+        SortedStream * stream_ = nullptr;
+    };
+
+    template<typename TapePtr, typename TapesContainer>
+    SortedStream(TapePtr && in, TapesContainer & tmp, SortOptions const & options = SortOptions{},
+                 std::size_t limit = detail::kUnlimited, Combine combine = Combine{})
+        : combine_{ std::move(combine) }
+        , remaining_{ limit } {
+        if constexpr (std::is_trivially_copyable<Value>::value) {
+            if (tmp.empty() && options.temporaryTapes != 0) {
+                ownedTapes_ = makeTemporaryTapes<Value>(options.temporaryTapes,
+                                                        options.temporaryDirectory.empty()
+                                                            ? defaultTemporaryDirectory()
+                                                            : options.temporaryDirectory);
+                start(detail::rawTape(in), ownedTapes_, options);
+                return;
+            }
+        }
+        start(detail::rawTape(in), tmp, options);
+    }
+
+    bool empty() const {
+        if constexpr (detail::kCombines<Combine>)
+            return !combined_;
+        else
+            return remaining_ == 0 || tree_.empty();
+    }
+
+    Value const & head() const {
+        if constexpr (detail::kCombines<Combine>)
+            return *combined_;
+        else
+            return tree_.topValue();
+    }
+
+    void next() {
+        if constexpr (detail::kCombines<Combine>) {
+            combineNext();
+        } else {
+            advance();
+            --remaining_;
+        }
+    }
+
+    iterator begin() { return iterator{ this }; }
+    iterator end() { return iterator{}; }
+
+private:
+    template<typename TapesContainer>
+    void start(Tape<Value> * in, TapesContainer & tmp, SortOptions const & options) {
+        std::size_t const memoryValues = options.memoryBytes / sizeof(Value);
+        budget_ = std::make_unique<MemoryBudget>(memoryValues * sizeof(Value));
+        if (remaining_ == 0)
+            return;
+
+        detail::NaturalRuns<Value> natural{ options, in, nullptr };
+        runs_ = detail::sortRuns(in, tmp, memoryValues, options, remaining_, combine_, natural,
+                                 *budget_);
+        std::size_t const codec = detail::codecBlock<Value>(memoryValues, options);
+        std::size_t const blockSize = memoryValues / std::max<std::size_t>(runs_.size(), 1);
+        if (blockSize < detail::bufferMemory<Value>(0, codec))
+            throw std::runtime_error("Insufficient memory to merge " + std::to_string(runs_.size())
+                                     + " runs at once");
+
+        readers_.reserve(runs_.size());
+        for (auto const & run : runs_) {
+            if (run.size != 0)
+                readers_.emplace_back(run.tape, run.offset, run.size, blockSize,
+                                      run.natural ? 0 : codec, budget_.get(), run.reversed);
+        }
+        tree_ = detail::LoserTree<Value>{ readers_.size() };
+        for (std::size_t i = 0; i < readers_.size(); ++i) {
+            if (!readers_[i].empty())
+                tree_.set(i, readers_[i].head());
+        }
+        tree_.build();
+        if constexpr (detail::kCombines<Combine>)
+            combineNext();
+    }
+
+    void advance() {
+        auto & reader = readers_[tree_.top()];
+        reader.next();
+        if (reader.empty())
+            tree_.popTop();
+        else
+            tree_.replaceTop(reader.head());
+    }
+
+    // Folds the next group of equivalent values into combined_.
+    void combineNext() {
+        if (remaining_ == 0 || tree_.empty()) {
+            combined_.reset();
+            return;
+        }
+        --remaining_;
+        combined_ = tree_.topValue();
+        advance();
+        while (!tree_.empty() && !(*combined_ < tree_.topValue())) {
+            combine_(*combined_, tree_.topValue());
+            advance();
+        }
+    }
+
+    std::vector<std::unique_ptr<Tape<Value>>> ownedTapes_;
+    // Behind a pointer, so the readers charging it can move with the stream.
+    std::unique_ptr<MemoryBudget> budget_;
+    // Kept for the tapes of the runs spanned over several, which the readers point into.
+    std::vector<detail::Run<Value>> runs_;
+    std::vector<detail::RunReader<Value>> readers_;
+    detail::LoserTree<Value> tree_{ 0 };
+    Combine combine_;
+    std::optional<Value> combined_;
+    std::size_t remaining_;
+};
+
+/*
+ * Writes the k smallest values of in to out, sorted, and returns how many it wrote. When k
+ * values fit in the memory budget next to an input block, a single pass keeps them in a bounded
+ * max-heap and nothing is spilled. Otherwise, or with a combiner, which needs the k smallest
+ * keys, it is a SortedStream limited to k, which keeps at most k values of every run on the
+ * temporary tapes, written out through an eighth of the memory.
+ */
+template<typename Value, typename TapePtr = Tape<Value> *,
+         typename TapesContainer = std::vector<TapePtr>, typename Combine = detail::NoCombine>
+std::size_t externalSortTopK(TapePtr && in, TapePtr && out, std::size_t k, TapesContainer & tmp,
+                             SortOptions const & options = SortOptions{},
+                             Combine combine = Combine{}) {
+    std::size_t const inputSize = in->size();
+    std::size_t const memoryValues = options.memoryBytes / sizeof(Value);
+    std::size_t const blockSize = std::max<std::size_t>(1, memoryValues / 16);
+    k = std::min(k, inputSize);
+    if (k == 0)
+        return 0;
+
+    if (!detail::kCombines<Combine> && k <= memoryValues && memoryValues - k >= blockSize) {
+        MemoryBudget budget{ memoryValues * sizeof(Value) };
+        Buffer<Value> heap{ BudgetAllocator<Value>{ &budget } };
+        heap.reserve(k);
+        {
+            detail::RunReader<Value> reader{ detail::rawTape(in), 0, inputSize, blockSize, 0,
+                                             &budget };
+            for (; !reader.empty(); reader.next()) {
+                if (heap.size() < k) {
+                    heap.push_back(reader.head());
+                    std::push_heap(heap.begin(), heap.end());
+                } else if (reader.head() < heap.front()) {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = reader.head();
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end());
+        out->pos(0);
+        out->writeBlock(heap.data(), heap.size());
+        out->flush();
+        return k;
+    }
+
+    SortOptions streamOptions = options;
+    streamOptions.memoryBytes = (memoryValues > blockSize ? memoryValues - blockSize : 0)
+                                * sizeof(Value);
+    SortedStream<Value, Combine> stream{ std::forward<TapePtr>(in), tmp, streamOptions, k,
+                                         std::move(combine) };
+    detail::RunWriter<Value> writer{ detail::rawTape(out), 0, blockSize };
+    std::size_t written = 0;
+    for (; !stream.empty(); stream.next()) {
+        writer.push(stream.head());
+        ++written;
+    }
+    writer.finish();
+    return written;
+}
+
+}  // namespace external_sort
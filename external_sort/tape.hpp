@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace external_sort
+{
+
+template<typename Value>
+class Tape
+{
+public:
+    using value_type = Value;
+    virtual ~Tape() = default;
+    virtual std::size_t pos() const = 0;
+    virtual void pos(std::size_t idx) = 0;
+    virtual value_type read() const = 0;
+    virtual std::size_t size() const = 0;
+    virtual std::size_t capacity() const = 0;
+    virtual void write(value_type value) = 0;
+    virtual void flush() = 0;
+
+    /*
+     * Bulk interface. Both calls start at pos() and leave the cursor right after the last
+     * transferred value. readBlock() returns how many values were actually read, which is less
+     * than count only at the end of the tape. The defaults are built on top of the per-value
+     * calls, so every tape supports them; override to move whole blocks at once.
+     */
+    virtual std::size_t readBlock(value_type * buffer, std::size_t count) {
+        std::size_t const start = pos();
+        std::size_t const available = size() > start ? size() - start : 0;
+        std::size_t const n = std::min(count, available);
+        for (std::size_t i = 0; i < n; ++i) {
+            pos(start + i);
+            buffer[i] = read();
+        }
+        pos(start + n);
+        return n;
+    }
+
+    virtual void writeBlock(value_type const * data, std::size_t count) {
+        std::size_t const start = pos();
+        for (std::size_t i = 0; i < count; ++i) {
+            pos(start + i);
+            write(data[i]);
+        }
+        pos(start + count);
+    }
+};
+
+}  // namespace external_sort
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace external_sort
+{
+namespace detail
+{
+
+/*
+ * Fixed set of worker threads fed from a FIFO of tasks. The result (or exception) of a task is
+ * delivered through the future returned by submit(). The destructor runs all queued tasks to
+ * completion before joining the workers.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(std::size_t threads) {
+        workers_.reserve(threads);
+        for (std::size_t i = 0; i < threads; ++i)
+            workers_.emplace_back([this] { work(); });
+    }
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool & operator=(ThreadPool const &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto & worker : workers_)
+            worker.join();
+    }
+
+    std::size_t size() const { return workers_.size(); }
+
+    template<typename F>
+    auto submit(F && task) -> std::future<decltype(task())> {
+        using result_type = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<result_type()>>(std::forward<F>(task));
+        auto result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            tasks_.emplace_back([packaged] { (*packaged)(); });
+        }
+        ready_.notify_one();
+        return result;
+    }
+
+private:
+    void work() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock{ mutex_ };
+                ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty())
+                    return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+}  // namespace detail
+}  // namespace external_sort
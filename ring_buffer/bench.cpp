@@ -0,0 +1,354 @@
+#include "mirrored_ring_buffer.h"
+#include "mpmc_ring_buffer.h"
+#include "overwrite_ring_buffer.h"
+#include "ring_buffer.h"
+#include "spsc_ring_buffer.h"
+#include "static_ring_buffer.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Passes integers between threads through the lock-free rings and through ring_buffer behind a
+ * mutex, and reports:
+ *   throughput: items/s streamed by a producer to a consumer, both spinning when blocked;
+ *   latency: round trips of an item sent through one ring and echoed back through another;
+ *   fan-in throughput: items/s streamed by several producers to as many consumers;
+ *   bulk: items/s through ring_buffer on one thread, one at a time and in batches of 256;
+ *   static: the same one at a time through static_ring_buffer with 256 slots;
+ *   spans: items/s summed in place through readable_spans() of ring_buffer and through the
+ *   single readable_spans() span of mirrored_ring_buffer (Linux), batches of 256 starting anywhere;
+ *   blocking: throughput of the spsc ring with push_wait()/pop_wait() instead of spinning, and
+ *   the CPU time burnt while a pop_wait() has nothing to pop for 200 ms;
+ *   overwrite: items/s pushed into overwrite_ring_buffer while a reader tails it, and how many
+ *   of them the reader lost to being lapped.
+ * ./ring_buffer_bench [items = 50000000] [capacity = 1024] [round trips = 1000000]
+ *                     [threads per side = 4]
+ */
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds(clock_type::time_point since) {
+    return std::chrono::duration<double>(clock_type::now() - since).count();
+}
+
+template<typename T>
+class mutex_ring_buffer
+{
+public:
+    explicit mutex_ring_buffer(std::size_t capacity)
+        : ring_{ capacity } {}
+
+    bool try_push(T v) {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        if (ring_.full())
+            return false;
+        ring_.push(std::move(v));
+        return true;
+    }
+
+    bool try_pop(T & v) {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        if (ring_.empty())
+            return false;
+        v = ring_.pop();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    ring_buffer<T> ring_;
+};
+
+// Spins on the ring, yielding now and then so the other side gets to run on a busy machine.
+template<typename Try>
+void spin_until(Try && attempt) {
+    for (std::size_t spins = 1; !attempt(); ++spins) {
+        if (spins % 64 == 0)
+            std::this_thread::yield();
+    }
+}
+
+template<typename Ring>
+void push_spinning(Ring & ring, std::uint64_t v) {
+    spin_until([&] { return ring.try_push(v); });
+}
+
+template<typename Ring>
+std::uint64_t pop_spinning(Ring & ring) {
+    std::uint64_t v;
+    spin_until([&] { return ring.try_pop(v); });
+    return v;
+}
+
+template<typename Ring>
+bool throughput(std::string const & name, std::size_t items, std::size_t capacity) {
+    Ring ring{ capacity };
+    bool ok = true;
+    auto const start = clock_type::now();
+    std::thread consumer{ [&] {
+        for (std::uint64_t i = 0; i < items; ++i)
+            ok = pop_spinning(ring) == i && ok;
+    } };
+    for (std::uint64_t i = 0; i < items; ++i)
+        push_spinning(ring, i);
+    consumer.join();
+    double const elapsed = seconds(start);
+    std::cout << name << " throughput: " << items / elapsed / 1e6 << " M items/s"
+              << (ok ? "" : ", FAILED") << std::endl;
+    return ok;
+}
+
+template<typename Ring>
+bool latency(std::string const & name, std::size_t round_trips, std::size_t capacity) {
+    Ring ping{ capacity };
+    Ring pong{ capacity };
+    std::thread echo{ [&] {
+        for (std::size_t i = 0; i < round_trips; ++i)
+            push_spinning(pong, pop_spinning(ping));
+    } };
+    std::vector<double> nanoseconds;
+    nanoseconds.reserve(round_trips);
+    bool ok = true;
+    for (std::uint64_t i = 0; i < round_trips; ++i) {
+        auto const start = clock_type::now();
+        push_spinning(ping, i);
+        ok = pop_spinning(pong) == i && ok;
+        nanoseconds.push_back(seconds(start) * 1e9);
+    }
+    echo.join();
+    std::sort(nanoseconds.begin(), nanoseconds.end());
+    std::cout << name << " round trip: median " << nanoseconds[round_trips / 2] << " ns, p99 "
+              << nanoseconds[round_trips * 99 / 100] << " ns" << (ok ? "" : ", FAILED")
+              << std::endl;
+    return ok;
+}
+
+template<typename Ring>
+bool fan_in_throughput(std::string const & name, std::size_t items, std::size_t capacity,
+                       std::size_t threads) {
+    Ring ring{ capacity };
+    std::atomic<std::size_t> popped{ 0 };
+    std::atomic<std::uint64_t> sum{ 0 };
+    auto const start = clock_type::now();
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (std::uint64_t i = t; i < items; i += threads)
+                push_spinning(ring, i);
+        });
+        workers.emplace_back([&] {
+            std::uint64_t local = 0;
+            while (popped.fetch_add(1, std::memory_order_relaxed) < items)
+                local += pop_spinning(ring);
+            sum.fetch_add(local, std::memory_order_relaxed);
+        });
+    }
+    for (auto & worker : workers)
+        worker.join();
+    double const elapsed = seconds(start);
+    bool const ok = sum == std::uint64_t(items) * (items - 1) / 2;
+    std::cout << name << " " << threads << "x" << threads << " throughput: "
+              << items / elapsed / 1e6 << " M items/s" << (ok ? "" : ", FAILED") << std::endl;
+    return ok;
+}
+
+bool bulk_throughput(std::size_t items, std::size_t capacity) {
+    constexpr std::size_t batch = 256;
+    ring_buffer<std::uint64_t> ring{ std::max(capacity, batch) };
+    std::vector<std::uint64_t> in(batch);
+    std::vector<std::uint64_t> out(batch);
+    std::uint64_t sum = 0;
+
+    auto start = clock_type::now();
+    for (std::size_t done = 0; done < items; done += batch) {
+        for (std::size_t i = 0; i < batch; ++i)
+            ring.push(done + i);
+        for (std::size_t i = 0; i < batch; ++i)
+            sum += ring.pop();
+    }
+    double const single = seconds(start);
+
+    start = clock_type::now();
+    for (std::size_t done = 0; done < items; done += batch) {
+        for (std::size_t i = 0; i < batch; ++i)
+            in[i] = done + i;
+        ring.push_n(in.data(), batch);
+        ring.pop_n(out.data(), batch);
+        for (std::size_t i = 0; i < batch; ++i)
+            sum -= out[i];
+    }
+    double const bulk = seconds(start);
+
+    bool const ok = sum == 0;
+    std::size_t const moved = (items + batch - 1) / batch * batch;
+    std::cout << "ring_buffer push/pop: " << moved / single / 1e6 << " M items/s, push_n/pop_n: "
+              << moved / bulk / 1e6 << " M items/s" << (ok ? "" : ", FAILED") << std::endl;
+    return ok;
+}
+
+bool static_throughput(std::size_t items) {
+    constexpr std::size_t batch = 256;
+    static_ring_buffer<std::uint64_t, batch> ring;
+    std::uint64_t sum = 0;
+    auto const start = clock_type::now();
+    for (std::size_t done = 0; done < items; done += batch) {
+        for (std::size_t i = 0; i < batch; ++i)
+            ring.push(done + i);
+        for (std::size_t i = 0; i < batch; ++i)
+            sum += ring.pop();
+    }
+    double const elapsed = seconds(start);
+    std::size_t const moved = (items + batch - 1) / batch * batch;
+    bool const ok = sum == std::uint64_t(moved) * (moved - 1) / 2;
+    std::cout << "static_ring_buffer push/pop: " << moved / elapsed / 1e6 << " M items/s"
+              << (ok ? "" : ", FAILED") << std::endl;
+    return ok;
+}
+
+// Fills the ring with batch values at a time and sums them in place, span by span.
+template<typename Ring, typename Spans>
+double sum_in_place(Ring & ring, std::size_t items, std::size_t batch, Spans && spans,
+                    std::uint64_t & sum) {
+    std::vector<std::uint64_t> in(batch);
+    // Offset the batches so they wrap around the end of the ring.
+    ring.push_n(in.data(), batch / 3);
+    ring.consume(batch / 3);
+    auto const start = clock_type::now();
+    for (std::size_t done = 0; done < items; done += batch) {
+        for (std::size_t i = 0; i < batch; ++i)
+            in[i] = done + i;
+        ring.push_n(in.data(), batch);
+        for (auto const & span : spans(ring)) {
+            for (std::uint64_t v : span)
+                sum += v;
+        }
+        ring.consume(batch);
+    }
+    return seconds(start);
+}
+
+bool span_throughput(std::size_t items) {
+    constexpr std::size_t batch = 256;
+    std::size_t const moved = (items + batch - 1) / batch * batch;
+    std::uint64_t const expected = std::uint64_t(moved) * (moved - 1) / 2;
+
+    ring_buffer<std::uint64_t> ring{ 2 * batch };
+    std::uint64_t sum = 0;
+    double const split = sum_in_place(ring, items, batch, [](auto & r) {
+        auto const spans = r.readable_spans();
+        return std::array<ring_span<std::uint64_t>, 2>{ spans.first, spans.second };
+    }, sum);
+    bool ok = sum == expected;
+    std::cout << "ring_buffer readable_spans: " << moved / split / 1e6 << " M items/s"
+              << (ok ? "" : ", FAILED") << std::endl;
+#ifdef __linux__
+    mirrored_ring_buffer<std::uint64_t> mirrored{ 2 * batch };
+    sum = 0;
+    double const flat = sum_in_place(mirrored, items, batch, [](auto & r) {
+        return std::array<ring_span<std::uint64_t>, 1>{ r.readable_spans() };
+    }, sum);
+    ok = sum == expected && ok;
+    std::cout << "mirrored_ring_buffer readable_spans: " << moved / flat / 1e6 << " M items/s"
+              << (sum == expected ? "" : ", FAILED") << std::endl;
+#endif
+    return ok;
+}
+
+bool blocking(std::size_t items, std::size_t capacity) {
+    spsc_ring_buffer<std::uint64_t> ring{ capacity };
+    bool ok = true;
+    auto const start = clock_type::now();
+    std::thread consumer{ [&] {
+        for (std::uint64_t i = 0; i < items; ++i)
+            ok = ring.pop_wait() == i && ok;
+    } };
+    for (std::uint64_t i = 0; i < items; ++i)
+        ring.push_wait(i);
+    consumer.join();
+    double const elapsed = seconds(start);
+
+    std::clock_t const cpu_start = std::clock();
+    std::thread idle{ [&] { ok = ring.pop_wait() == items && ok; } };
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ring.push_wait(items);
+    idle.join();
+    double const cpu_ms = double(std::clock() - cpu_start) * 1e3 / CLOCKS_PER_SEC;
+    std::cout << "spsc push_wait/pop_wait throughput: " << items / elapsed / 1e6
+              << " M items/s, idle pop_wait: " << cpu_ms << " ms CPU in 200 ms"
+              << (ok ? "" : ", FAILED") << std::endl;
+    return ok;
+}
+
+bool overwrite_throughput(std::size_t items, std::size_t capacity) {
+    overwrite_ring_buffer<std::uint64_t> ring{ capacity };
+    std::atomic<bool> done{ false };
+    std::uint64_t read = 0;
+    std::uint64_t lost = 0;
+    bool ok = true;
+    std::thread reader{ [&] {
+        std::uint64_t sequence = 0;
+        std::uint64_t v;
+        for (;;) {
+            std::uint64_t const wanted = sequence;
+            if (!ring.read(sequence, v)) {
+                if (done.load(std::memory_order_acquire) && sequence >= ring.next_sequence())
+                    break;
+                std::this_thread::yield();
+                continue;
+            }
+            ok = v == sequence && ok;
+            lost += sequence - wanted;
+            ++read;
+            ++sequence;
+        }
+    } };
+    auto const start = clock_type::now();
+    for (std::uint64_t i = 0; i < items; ++i)
+        ring.push(i);
+    double const elapsed = seconds(start);
+    done.store(true, std::memory_order_release);
+    reader.join();
+    ok = read + lost == items && ok;
+    std::cout << "overwrite push: " << items / elapsed / 1e6 << " M items/s, reader lost " << lost
+              << " of " << items << (ok ? "" : ", FAILED") << std::endl;
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+    std::size_t const items = argc > 1 ? std::stoull(argv[1]) : 50000000;
+    std::size_t const capacity = argc > 2 ? std::stoull(argv[2]) : 1024;
+    std::size_t const round_trips =
+        std::max<std::size_t>(argc > 3 ? std::stoull(argv[3]) : 1000000, 1);
+    std::size_t const threads = std::max<std::size_t>(argc > 4 ? std::stoull(argv[4]) : 4, 1);
+
+    bool ok = true;
+    ok = throughput<spsc_ring_buffer<std::uint64_t>>("spsc", items, capacity) && ok;
+    ok = throughput<mutex_ring_buffer<std::uint64_t>>("mutex", items, capacity) && ok;
+    ok = latency<spsc_ring_buffer<std::uint64_t>>("spsc", round_trips, capacity) && ok;
+    ok = latency<mutex_ring_buffer<std::uint64_t>>("mutex", round_trips, capacity) && ok;
+    ok = fan_in_throughput<mpmc_ring_buffer<std::uint64_t>>("mpmc", items, capacity, threads)
+         && ok;
+    ok = fan_in_throughput<mutex_ring_buffer<std::uint64_t>>("mutex", items, capacity, threads)
+         && ok;
+    ok = bulk_throughput(items, capacity) && ok;
+    ok = static_throughput(items) && ok;
+    ok = span_throughput(items) && ok;
+    ok = blocking(items, capacity) && ok;
+    ok = overwrite_throughput(items, capacity) && ok;
+    return ok ? 0 : 1;
+}
@@ -1,6 +1,21 @@
+#include "mirrored_ring_buffer.h"
+#include "mpmc_ring_buffer.h"
+#include "overwrite_ring_buffer.h"
 #include "ring_buffer.h"
+#include "ring_waiter.h"
+#include "spsc_ring_buffer.h"
+#include "static_ring_buffer.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 constexpr std::size_t max_arena_size = 100ULL * 1024 * 1024;
 
@@ -33,7 +48,489 @@ struct test_ring
     }
 };
 
+// The values of the ring read in place through readable_spans(), oldest first.
+template<typename T>
+std::vector<T> contents(ring_buffer<T> & ring) {
+    std::vector<T> result;
+    auto const spans = ring.readable_spans();
+    result.insert(result.end(), spans.first.begin(), spans.first.end());
+    result.insert(result.end(), spans.second.begin(), spans.second.end());
+    return result;
+}
+
+// Whether the ring holds expected, as seen through readable_spans(), front() and peek().
+template<typename T>
+bool holds(ring_buffer<T> & ring, std::vector<T> const & expected) {
+    if (contents(ring) != expected || ring.size() != expected.size()
+        || ring.peek(expected.size()) != nullptr)
+        return false;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        if (ring.peek(i) == nullptr || *ring.peek(i) != expected[i])
+            return false;
+    }
+    return expected.empty() || ring.front() == expected.front();
+}
+
+template<typename Error, typename F>
+bool throws(F && f) {
+    try {
+        f();
+    } catch (Error const &) {
+        return true;
+    }
+    return false;
+}
+
+bool check(bool ok, char const * what) {
+    if (!ok)
+        std::cerr << "check failed: " << what << std::endl;
+    return ok;
+}
+
+// Front, peek, the span access and push_overwrite() on empty, full and wrapped rings.
+bool check_spans() {
+    bool ok = true;
+    ring_buffer<int> ring(5);
+    ok = check(holds(ring, {}), "empty ring") && ok;
+    ok = check(throws<std::underflow_error>([&] { ring.front(); }), "front of empty ring") && ok;
+    ok = check(throws<std::underflow_error>([&] { ring.consume(1); }), "consume past empty")
+         && ok;
+    ring.consume(0);
+
+    // Free space split at the end of the buffer: one slot there, three at the start.
+    for (int i = 0; i < 4; ++i)
+        ring.push(i);
+    ring.consume(3);
+    ok = check(holds(ring, { 3 }), "consume(3)") && ok;
+    auto writable = ring.writable_spans();
+    ok = check(writable.first.size == 1 && writable.second.size == 3, "wrapped writable_spans")
+         && ok;
+    int next = 10;
+    for (int & slot : writable.first)
+        slot = next++;
+    for (int & slot : writable.second)
+        slot = next++;
+    ok = check(throws<std::overflow_error>([&] { ring.commit(5); }), "commit past free space")
+         && ok;
+    ring.commit(4);
+    ok = check(ring.full() && holds(ring, { 3, 10, 11, 12, 13 }), "commit(4) to full") && ok;
+    auto const readable = ring.readable_spans();
+    ok = check(readable.first.size == 2 && readable.second.size == 3, "wrapped readable_spans")
+         && ok;
+    ok = check(ring.writable_spans().size() == 0, "writable_spans of full ring") && ok;
+    ok = check(throws<std::overflow_error>([&] { ring.commit(1); }), "commit to full ring") && ok;
+    ok = check(throws<std::overflow_error>([&] { ring.push(14); }), "push to full ring") && ok;
+
+    ring.push_overwrite(14);
+    ring.push_overwrite(15);
+    ok = check(ring.full() && holds(ring, { 11, 12, 13, 14, 15 }), "push_overwrite on full ring")
+         && ok;
+    ok = check(throws<std::underflow_error>([&] { ring.consume(6); }), "consume past size") && ok;
+    ring.consume(5);
+    ok = check(ring.empty() && holds(ring, {}), "consume(5) to empty") && ok;
+    ring.push_overwrite(16);
+    ok = check(holds(ring, { 16 }), "push_overwrite on empty ring") && ok;
+
+    ring_buffer<std::string> strings(3);
+    for (char const * s : { "a", "b", "c", "d", "e" })
+        strings.push_overwrite(s);
+    ok = check(holds(strings, { "c", "d", "e" }), "push_overwrite of strings") && ok;
+    strings.front() = "x";
+    ok = check(holds(strings, { "x", "d", "e" }), "assignment through front()") && ok;
+    strings.consume(2);
+    ok = check(holds(strings, { "e" }), "consume of strings") && ok;
+    return ok;
+}
+
+// Moves first the values from first, then second, through the ring with push_n() and
+// pop_n(), so that both wrap around, and whether they come out in order.
+template<typename Ring, typename InputIt, typename OutputIt>
+bool wraps_in_order(Ring & ring, InputIt first, OutputIt out) {
+    std::size_t const c = ring.capacity();
+    bool ok = ring.push_n(first, c - 2) == c - 2;
+    std::advance(first, c - 2);
+    ok = ring.pop_n(out, c - 3) == c - 3 && ok;
+    // An inserter moves on by itself.
+    if constexpr (std::is_pointer<OutputIt>::value)
+        out += c - 3;
+    // One slot is left from before, the rest of the room is split at the end of the buffer.
+    ok = ring.push_n(first, c) == c - 1 && ok;
+    ok = ring.pop_n(out, c + 5) == c && ok;
+    return ring.empty() && ok;
+}
+
+template<typename Ring, typename T>
+bool check_bulk(Ring & ring, std::vector<T> const & values, char const * what) {
+    std::size_t const moved = 2 * ring.capacity() - 3;
+    std::vector<T> const expected(values.begin(), values.begin() + moved);
+    bool ok = true;
+    std::vector<T> out(moved);
+    ok = check(wraps_in_order(ring, values.data(), out.data()) && out == expected, what) && ok;
+    std::vector<T> appended;
+    ok = check(wraps_in_order(ring, values.begin(), std::back_inserter(appended))
+                   && appended == expected,
+               what)
+         && ok;
+    return ok;
+}
+
+// Counts its instances, and its move-assignment throws once assignments_left runs out.
+struct fragile
+{
+    static inline int live = 0;
+    static inline int assignments_left = 0;
+
+    std::string value;
+
+    fragile() { ++live; }
+    fragile(std::string v)
+        : value{ std::move(v) } {
+        ++live;
+    }
+    fragile(fragile const & other)
+        : value{ other.value } {
+        ++live;
+    }
+    fragile(fragile && other) noexcept
+        : value{ std::move(other.value) } {
+        ++live;
+    }
+    ~fragile() { --live; }
+
+    fragile & operator=(fragile && other) {
+        if (assignments_left-- == 0)
+            throw std::runtime_error("fragile assignment");
+        value = std::move(other.value);
+        return *this;
+    }
+};
+
+// A move-assignment that throws partway through a wrapped pop_n() leaves the values before it
+// popped and the one that threw as the oldest.
+template<typename Ring>
+bool check_throwing_pop_n(Ring & ring, char const * what) {
+    std::size_t const c = ring.capacity();
+    for (std::size_t i = 0; i < c / 2; ++i)
+        ring.push(fragile{ "x" });
+    for (std::size_t i = 0; i < c / 2; ++i)
+        ring.pop();
+    for (std::size_t i = 0; i < c; ++i)
+        ring.push(fragile{ std::to_string(i) });
+    std::vector<fragile> out(c);
+    fragile::assignments_left = int(c) - 2;
+    bool ok = throws<std::runtime_error>([&] { ring.pop_n(out.data(), c); });
+    fragile::assignments_left = int(c);
+    ok = ok && ring.size() == 2 && out[c - 3].value == std::to_string(c - 3);
+    ok = ok && ring.pop().value == std::to_string(c - 2);
+    ok = ok && ring.pop_n(out.data(), c) == 1 && out[0].value == std::to_string(c - 1);
+    return check(ok && ring.empty(), what);
+}
+
+// push_n() and pop_n() across the end of the buffer, with memcpy and element by element.
+bool check_push_pop_n() {
+    std::vector<int> ints(64);
+    for (std::size_t i = 0; i < ints.size(); ++i)
+        ints[i] = int(i);
+    std::vector<std::string> strings;
+    for (std::size_t i = 0; i < 64; ++i)
+        strings.push_back("value " + std::to_string(i));
+
+    bool ok = true;
+    ring_buffer<int> ring_ints(7);
+    ok = check_bulk(ring_ints, ints, "ring_buffer<int> push_n/pop_n") && ok;
+    ring_buffer<std::string> ring_strings(7);
+    ok = check_bulk(ring_strings, strings, "ring_buffer<std::string> push_n/pop_n") && ok;
+    static_ring_buffer<int, 8> static_ints;
+    ok = check_bulk(static_ints, ints, "static_ring_buffer<int, 8> push_n/pop_n") && ok;
+    static_ring_buffer<std::string, 6> static_strings;
+    ok = check_bulk(static_strings, strings, "static_ring_buffer<std::string, 6> push_n/pop_n")
+         && ok;
+
+    {
+        ring_buffer<fragile> ring(6);
+        ok = check_throwing_pop_n(ring, "ring_buffer pop_n with a throwing assignment") && ok;
+        static_ring_buffer<fragile, 8> static_ring;
+        ok = check_throwing_pop_n(static_ring,
+                                  "static_ring_buffer pop_n with a throwing assignment")
+             && ok;
+    }
+    return check(fragile::live == 0, "fragile values destroyed once") && ok;
+}
+
+// Capacity, failed pushes and pops, order across laps, and a producer and a consumer thread.
+bool check_spsc() {
+    bool ok = true;
+    spsc_ring_buffer<std::string> ring(5);
+    ok = check(ring.capacity() == 5 && ring.empty(), "spsc capacity is exact") && ok;
+    std::string v = "kept";
+    ok = check(!ring.try_pop(v) && v == "kept", "spsc try_pop on empty ring") && ok;
+    ok = check(throws<std::underflow_error>([&] { ring.pop(); }), "spsc pop on empty ring") && ok;
+
+    std::size_t pushed = 0;
+    std::size_t popped = 0;
+    bool in_order = true;
+    for (std::size_t lap = 0; lap < 4; ++lap) {
+        while (ring.try_push(std::to_string(pushed)))
+            ++pushed;
+        in_order = in_order && ring.full() && ring.size() == 5;
+        for (std::size_t i = 0; i < 3; ++i)
+            in_order = in_order && ring.pop() == std::to_string(popped++);
+    }
+    ok = check(in_order, "spsc order across laps") && ok;
+    while (!ring.full())
+        ring.push(std::to_string(pushed++));
+    ok = check(!ring.try_push(std::move(v)) && v == "kept", "spsc try_push on full ring") && ok;
+    ok = check(throws<std::overflow_error>([&] { ring.push("x"); }), "spsc push on full ring")
+         && ok;
+    while (ring.try_pop(v))
+        in_order = in_order && v == std::to_string(popped++);
+    ok = check(in_order && popped == pushed && ring.empty(), "spsc drain in order") && ok;
+
+    constexpr int count = 100000;
+    spsc_ring_buffer<int> ints(64);
+    std::thread producer{ [&ints] {
+        for (int i = 0; i < count; ++i)
+            ints.push_wait(i);
+    } };
+    bool received = true;
+    for (int i = 0; i < count; ++i)
+        received = ints.pop_wait() == i && received;
+    producer.join();
+    return check(received && ints.empty(), "spsc values between threads in order") && ok;
+}
+
+// Capacity rounding, failed pushes and pops, and every value handed over exactly once between
+// two producers and two consumers.
+bool check_mpmc() {
+    bool ok = check(mpmc_ring_buffer<int>(1).capacity() == 2
+                        && mpmc_ring_buffer<int>(5).capacity() == 8
+                        && mpmc_ring_buffer<int>(8).capacity() == 8,
+                    "mpmc capacity rounds up to a power of two")
+              && check(throws<std::invalid_argument>([] { mpmc_ring_buffer<int>(0); }),
+                       "mpmc ring without a capacity");
+
+    mpmc_ring_buffer<std::string> ring(3);
+    std::string v = "kept";
+    ok = check(!ring.try_pop(v) && v == "kept", "mpmc try_pop on empty ring") && ok;
+    std::size_t pushed = 0;
+    std::size_t popped = 0;
+    bool in_order = true;
+    for (std::size_t lap = 0; lap < 4; ++lap) {
+        while (ring.try_push(std::to_string(pushed)))
+            ++pushed;
+        in_order = in_order && ring.full() && ring.size() == 4;
+        for (std::size_t i = 0; i < 3 && ring.try_pop(v); ++i)
+            in_order = in_order && v == std::to_string(popped++);
+    }
+    ok = check(in_order, "mpmc order across laps") && ok;
+    while (ring.try_emplace(std::to_string(pushed)))
+        ++pushed;
+    v = "kept";
+    ok = check(!ring.try_push(std::move(v)) && v == "kept", "mpmc try_push on full ring") && ok;
+    while (ring.try_pop(v))
+        in_order = in_order && v == std::to_string(popped++);
+    ok = check(in_order && popped == pushed && ring.empty(), "mpmc drain in order") && ok;
+
+    constexpr int per_producer = 20000;
+    mpmc_ring_buffer<int> ints(16);
+    std::vector<int> seen(2 * per_producer, 0);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < 2; ++p)
+        threads.emplace_back([&ints, p] {
+            for (int i = 0; i < per_producer; ++i)
+                ints.push_wait(p * per_producer + i);
+        });
+    for (int c = 0; c < 2; ++c)
+        threads.emplace_back([&ints, &seen] {
+            for (int i = 0; i < per_producer; ++i) {
+                int value;
+                ints.pop_wait(value);
+                ++seen[value];
+            }
+        });
+    for (std::thread & t : threads)
+        t.join();
+    bool once = ints.empty();
+    for (int n : seen)
+        once = once && n == 1;
+    return check(once, "mpmc values handed over exactly once") && ok;
+}
+
+// Runs a timed wait that cannot succeed, true if it gave up no earlier than its timeout.
+template<typename Wait>
+bool times_out(std::chrono::milliseconds timeout, Wait && wait) {
+    auto const start = ring_waiter::clock_type::now();
+    bool const done = wait(timeout);
+    return !done && ring_waiter::clock_type::now() - start >= timeout;
+}
+
+// Timed waits on a full or empty ring give up after their timeout and leave the argument alone,
+// and a waiter is woken by a push from another thread well before its timeout.
+template<typename Ring>
+bool check_timed_waits(char const * name) {
+    using namespace std::chrono_literals;
+    bool ok = true;
+    Ring ring(2);
+    std::string v = "kept";
+    ok = check(times_out(20ms, [&](auto timeout) { return ring.pop_wait_for(v, timeout); })
+                   && v == "kept",
+               name)
+         && ok;
+    while (ring.try_push("x"))
+        ;
+    ok = check(times_out(20ms,
+                         [&](auto timeout) { return ring.push_wait_for(std::move(v), timeout); })
+                   && v == "kept",
+               name)
+         && ok;
+    while (ring.try_pop(v))
+        ;
+
+    std::thread producer{ [&ring] {
+        std::this_thread::sleep_for(20ms);
+        ring.push_wait(std::string("late"));
+    } };
+    bool const woken = ring.pop_wait_for(v, 10s);
+    producer.join();
+    return check(woken && v == "late", name) && ok;
+}
+
+bool check_timed_waits() {
+    using namespace std::chrono_literals;
+    ring_waiter waiter;
+    auto const deadline = ring_waiter::deadline_after(20ms);
+    bool ok = check(!waiter.wait([] { return false; }, &deadline)
+                        && ring_waiter::clock_type::now() >= deadline,
+                    "ring_waiter gives up at its deadline");
+    ok = check_timed_waits<spsc_ring_buffer<std::string>>("spsc timed waits") && ok;
+    return check_timed_waits<mpmc_ring_buffer<std::string>>("mpmc timed waits") && ok;
+}
+
+// Every word holds the sequence number it was pushed with, so a torn copy shows.
+struct stamp
+{
+    std::uint64_t words[6];
+
+    explicit stamp(std::uint64_t sequence = 0) {
+        for (std::uint64_t & w : words)
+            w = sequence;
+    }
+
+    bool holds(std::uint64_t sequence) const {
+        for (std::uint64_t w : words)
+            if (w != sequence)
+                return false;
+        return true;
+    }
+};
+
+// Capacity rounding, a lapped reader skipping to the oldest value left, snapshots, and readers
+// racing a writer that never get a torn or misnumbered value.
+bool check_overwrite() {
+    bool ok = check(overwrite_ring_buffer<int>(1).capacity() == 1
+                        && overwrite_ring_buffer<int>(5).capacity() == 8,
+                    "overwrite capacity rounds up to a power of two")
+              && check(throws<std::invalid_argument>([] { overwrite_ring_buffer<int>(0); }),
+                       "overwrite ring without a capacity");
+
+    overwrite_ring_buffer<stamp> ring(8);
+    stamp v{ 99 };
+    std::uint64_t sequence = 0;
+    ok = check(!ring.read(sequence, v) && v.holds(99) && ring.empty(), "overwrite read on empty")
+         && ok;
+    for (std::uint64_t i = 0; i < 20; ++i)
+        ring.push(stamp{ i });
+    ok = check(ring.size() == 8 && ring.next_sequence() == 20, "overwrite size once lapped") && ok;
+    ok = check(ring.read(sequence, v) && sequence == 12 && v.holds(12),
+               "lapped overwrite reader skips to the oldest value")
+         && ok;
+    bool in_order = true;
+    while (ring.read(++sequence, v))
+        in_order = in_order && v.holds(sequence);
+    ok = check(in_order && sequence == 20 && v.holds(19), "overwrite reads up to the newest")
+         && ok;
+    std::vector<stamp> out(10);
+    std::uint64_t first = 0;
+    std::size_t const copied = ring.snapshot(out.data(), out.size(), &first);
+    for (std::size_t i = 0; i < copied; ++i)
+        in_order = in_order && out[i].holds(first + i);
+    ok = check(copied == 8 && first == 12 && in_order, "overwrite snapshot of the newest") && ok;
+
+    constexpr std::uint64_t count = 50000;
+    overwrite_ring_buffer<stamp> racing(4);
+    std::atomic<bool> done{ false };
+    std::thread writer{ [&] {
+        for (std::uint64_t i = 0; i < count; ++i) {
+            racing.push(stamp{ i });
+            if (i % 64 == 0)
+                std::this_thread::yield();
+        }
+        done.store(true);
+    } };
+    bool consistent = true;
+    std::uint64_t skipped = 0;
+    std::uint64_t next = 0;
+    std::vector<stamp> copies(racing.capacity());
+    while (!done.load() || next < racing.next_sequence()) {
+        std::uint64_t read_sequence = next;
+        if (racing.read(read_sequence, v)) {
+            consistent = consistent && read_sequence >= next && v.holds(read_sequence);
+            skipped += read_sequence - next;
+            next = read_sequence + 1;
+        }
+        std::size_t const n = racing.snapshot(copies.data(), copies.size(), &first);
+        for (std::size_t i = 0; i < n; ++i)
+            consistent = consistent && copies[i].holds(first + i);
+        std::this_thread::yield();
+    }
+    writer.join();
+    return check(consistent && next == count, "overwrite readers never see torn values")
+           && check(skipped < count, "overwrite reader keeps up at times") && ok;
+}
+
+#ifdef __linux__
+// Values written across the wrap point through the mirror come back as one contiguous block.
+bool check_mirrored() {
+    mirrored_ring_buffer<std::uint32_t> ring(1000);
+    std::size_t const capacity = ring.capacity();
+    bool ok = check(capacity >= 1000 && capacity * sizeof(std::uint32_t) % 4096 == 0,
+                    "mirrored capacity fills whole pages");
+
+    std::vector<std::uint32_t> values(capacity - 3, 0);
+    ring.push_n(values.data(), values.size());
+    ring.pop_n(values.data(), values.size());
+    ring_span<std::uint32_t> const writable = ring.writable_spans();
+    ok = check(writable.size == capacity, "mirrored writable_spans is one span") && ok;
+    for (std::uint32_t i = 0; i < 10; ++i)
+        writable.data[i] = i;
+    ring.commit(10);
+
+    ring_span<std::uint32_t> const readable = ring.readable_spans();
+    bool in_order = readable.data == writable.data && readable.size == 10;
+    for (std::uint32_t i = 0; in_order && i < 10; ++i)
+        in_order = readable.data[i] == i && *ring.peek(i) == i;
+    ok = check(in_order, "mirrored write across the wrap reads back contiguous") && ok;
+    std::uint32_t out[10] = {};
+    ring.pop_n(out, 10);
+    for (std::uint32_t i = 0; i < 10; ++i)
+        in_order = in_order && out[i] == i;
+    return check(in_order && ring.empty(), "mirrored pop_n across the wrap") && ok;
+}
+#endif
+
 int main(int, char **) {
+    bool ok = check_spans();
+    ok = check_push_pop_n() && ok;
+    ok = check_spsc() && ok;
+    ok = check_mpmc() && ok;
+    ok = check_timed_waits() && ok;
+    ok = check_overwrite() && ok;
+#ifdef __linux__
+    ok = check_mirrored() && ok;
+#endif
+    if (!ok)
+        return 1;
+
     auto int_factory = [](std::size_t i) -> int { return i; };
 
     {
@@ -0,0 +1,154 @@
+#pragma once
+
+#ifdef __linux__
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Ring whose storage is mapped twice back to back (Linux): the pages of a memfd are mapped at
+ * base and again at base + capacity(), so slot capacity() + i is slot i, and any window of up to
+ * capacity() values starting at any slot is contiguous in memory. readable_spans() and
+ * writable_spans() therefore hand out a single span where ring_buffer needs two, and a parser or
+ * a memcpy can treat the ring as a flat array; push_n() and pop_n() are a single memcpy for the
+ * same reason. The capacity is rounded up so that it fills whole pages. Single values are only
+ * accessed through their first mapping by the ring itself; since the same bytes are visible at
+ * two addresses, T must be trivially copyable. Elsewhere than on Linux this header is empty.
+ */
+template<typename T>
+class mirrored_ring_buffer
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "mirrored_ring_buffer needs trivially copyable values");
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+
+    explicit mirrored_ring_buffer(size_type capacity) {
+        size_type const page = size_type(::sysconf(_SC_PAGESIZE));
+        size_type const unit = std::lcm(page, sizeof(T));
+        bytes_ = (std::max<size_type>(capacity, 1) * sizeof(T) + unit - 1) / unit * unit;
+        capacity_ = bytes_ / sizeof(T);
+
+        int const fd = ::memfd_create("ring_buffer", MFD_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "memfd_create");
+        void * base = MAP_FAILED;
+        if (::ftruncate(fd, off_t(bytes_)) == 0)
+            base = ::mmap(nullptr, 2 * bytes_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bool mapped = base != MAP_FAILED;
+        for (size_type half = 0; mapped && half < 2; ++half) {
+            mapped = ::mmap(static_cast<char *>(base) + half * bytes_, bytes_,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+                     != MAP_FAILED;
+        }
+        int const error = errno;
+        ::close(fd);
+        if (!mapped) {
+            if (base != MAP_FAILED)
+                ::munmap(base, 2 * bytes_);
+            throw std::system_error(error, std::generic_category(), "mirrored ring mapping");
+        }
+        data_ = static_cast<T *>(base);
+    }
+
+    mirrored_ring_buffer(mirrored_ring_buffer const &) = delete;
+    mirrored_ring_buffer & operator=(mirrored_ring_buffer const &) = delete;
+
+    ~mirrored_ring_buffer() { ::munmap(data_, 2 * bytes_); }
+
+    void push(value_type v) {
+        if (full())
+            throw std::overflow_error("ring overflow");
+        data_[wrap(tail_ + size_)] = v;
+        ++size_;
+    }
+
+    value_type pop() {
+        if (empty())
+            throw std::underflow_error("ring underflow");
+        value_type result = data_[tail_];
+        consume(1);
+        return result;
+    }
+
+    // As ring_buffer::push_n() and pop_n(), from and to contiguous memory, in one memcpy that
+    // may run into the mirror.
+    size_type push_n(value_type const * values, size_type n) {
+        n = std::min(n, capacity_ - size_);
+        if (n == 0)
+            return 0;
+        std::memcpy(data_ + wrap(tail_ + size_), values, n * sizeof(T));
+        size_ += n;
+        return n;
+    }
+
+    size_type pop_n(value_type * out, size_type n) {
+        n = std::min(n, size_);
+        if (n == 0)
+            return 0;
+        std::memcpy(out, data_ + tail_, n * sizeof(T));
+        consume(n);
+        return n;
+    }
+
+    value_type & front() {
+        if (empty())
+            throw std::underflow_error("ring underflow");
+        return data_[tail_];
+    }
+
+    value_type * peek(size_type i = 0) { return i < size_ ? &data_[wrap(tail_ + i)] : nullptr; }
+
+    // All of the values, oldest first, in one span that may run into the mirror.
+    ring_span<value_type> readable_spans() { return { data_ + tail_, size_ }; }
+
+    void consume(size_type n) {
+        if (n > size_)
+            throw std::underflow_error("ring underflow");
+        tail_ = wrap(tail_ + n);
+        size_ -= n;
+    }
+
+    // All of the free slots, in one span that may run into the mirror.
+    ring_span<value_type> writable_spans() {
+        return { data_ + wrap(tail_ + size_), capacity_ - size_ };
+    }
+
+    void commit(size_type n) {
+        if (n > capacity_ - size_)
+            throw std::overflow_error("ring overflow");
+        size_ += n;
+    }
+
+    size_type size() const { return size_; }
+
+    size_type capacity() const { return capacity_; }
+
+    bool empty() const { return size_ == 0; }
+
+    bool full() const { return size_ == capacity_; }
+
+private:
+    size_type wrap(size_type idx) const { return idx >= capacity_ ? idx - capacity_ : idx; }
+
+private:
+    T * data_ = nullptr;
+    size_type bytes_ = 0;
+    size_type capacity_ = 0;
+    size_type tail_ = 0;
+    size_type size_ = 0;
+};
+#endif
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "ring_buffer.h"
+#include "ring_detail.h"
+#include "ring_waiter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Bounded lock-free queue for any number of producer and consumer threads (D. Vyukov's bounded
+ * MPMC queue). Every slot carries a sequence number next to its storage: a slot at position pos
+ * is free for the producer that claims pos when its sequence is pos, and holds a value for the
+ * consumer that claims pos when its sequence is pos + 1. Producers and consumers claim positions
+ * with a CAS on their own counter, each on its own cache line, and hand the slot over with a
+ * release store of the next sequence, so there is no global lock and threads only contend on
+ * the counter of their side. All memory is allocated by the constructor. The capacity is rounded
+ * up to a power of two so positions map to slots with a mask, and to at least two, as with a
+ * single slot a full one would look free for the next lap. A claimed slot must be filled, so
+ * values are built before claiming one and moving them must not throw. The _wait calls spin and
+ * then sleep until another thread pushes (or pops), which wakes one sleeper at a time.
+ */
+template<typename T, typename Allocator = std::allocator<T>>
+class mpmc_ring_buffer
+{
+    static_assert(std::is_nothrow_move_constructible<T>::value
+                      && std::is_nothrow_move_assignable<T>::value,
+                  "mpmc_ring_buffer needs values that move without throwing");
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using allocator_type = Allocator;
+    using storage_item_type = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+private:
+    struct cell
+    {
+        std::atomic<size_type> sequence;
+        storage_item_type storage;
+    };
+
+    using cell_allocator_type = typename allocator_type::template rebind<cell>::other;
+
+public:
+    mpmc_ring_buffer(size_type capacity, allocator_type allocator = allocator_type())
+        : allocator_{ allocator }
+        , cell_allocator_{ allocator_ }
+        , mask_{ ring_detail::round_up_to_power_of_two(capacity, 2, "mpmc ring needs a capacity")
+                 - 1 }
+        , cells_(mask_ + 1, cell_allocator_) {
+        for (size_type i = 0; i < cells_.size(); ++i)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    mpmc_ring_buffer(mpmc_ring_buffer const &) = delete;
+    mpmc_ring_buffer & operator=(mpmc_ring_buffer const &) = delete;
+
+    ~mpmc_ring_buffer() {
+        size_type const head = enqueue_pos_.value.load(std::memory_order_acquire);
+        for (size_type pos = dequeue_pos_.value.load(std::memory_order_relaxed); pos != head;
+             ++pos)
+            std::launder(reinterpret_cast<T *>(&cells_[pos & mask_].storage))->T::~T();
+    }
+
+    bool try_push(value_type && v) {
+        size_type pos = enqueue_pos_.value.load(std::memory_order_relaxed);
+        cell * c;
+        for (;;) {
+            c = &cells_[pos & mask_];
+            size_type const sequence = c->sequence.load(std::memory_order_acquire);
+            auto const diff = std::intptr_t(sequence) - std::intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.value.compare_exchange_weak(pos, pos + 1,
+                                                             std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.value.load(std::memory_order_relaxed);
+            }
+        }
+        new (&c->storage) value_type(std::move(v));
+        c->sequence.store(pos + 1, std::memory_order_release);
+        data_waiter_.notify();
+        return true;
+    }
+
+    bool try_push(value_type const & v) { return try_push(value_type(v)); }
+
+    template<typename... Args>
+    bool try_emplace(Args &&... args) {
+        return try_push(value_type(std::forward<Args>(args)...));
+    }
+
+    void push_wait(value_type v) {
+        room_waiter_.wait([&] { return try_push(std::move(v)); });
+    }
+
+    // False, with v left as it was, when the ring is still full after timeout.
+    template<typename Rep, typename Period>
+    bool push_wait_for(value_type && v, std::chrono::duration<Rep, Period> timeout) {
+        auto const deadline = ring_waiter::deadline_after(timeout);
+        return room_waiter_.wait([&] { return try_push(std::move(v)); }, &deadline);
+    }
+
+    template<typename Rep, typename Period>
+    bool push_wait_for(value_type const & v, std::chrono::duration<Rep, Period> timeout) {
+        return push_wait_for(value_type(v), timeout);
+    }
+
+    bool try_pop(value_type & v) {
+        size_type pos = dequeue_pos_.value.load(std::memory_order_relaxed);
+        cell * c;
+        for (;;) {
+            c = &cells_[pos & mask_];
+            size_type const sequence = c->sequence.load(std::memory_order_acquire);
+            auto const diff = std::intptr_t(sequence) - std::intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.value.compare_exchange_weak(pos, pos + 1,
+                                                             std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.value.load(std::memory_order_relaxed);
+            }
+        }
+        T * value_ptr = std::launder(reinterpret_cast<T *>(&c->storage));
+        v = std::move(*value_ptr);
+        value_ptr->T::~T();
+        c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        room_waiter_.notify();
+        return true;
+    }
+
+    void pop_wait(value_type & v) {
+        data_waiter_.wait([&] { return try_pop(v); });
+    }
+
+    // False, with v left as it was, when the ring is still empty after timeout.
+    template<typename Rep, typename Period>
+    bool pop_wait_for(value_type & v, std::chrono::duration<Rep, Period> timeout) {
+        auto const deadline = ring_waiter::deadline_after(timeout);
+        return data_waiter_.wait([&] { return try_pop(v); }, &deadline);
+    }
+
+    // A snapshot, only exact while no other thread pushes or pops.
+    size_type size() const {
+        size_type const tail = dequeue_pos_.value.load(std::memory_order_acquire);
+        size_type const head = enqueue_pos_.value.load(std::memory_order_acquire);
+        return head > tail ? std::min(head - tail, capacity()) : 0;
+    }
+
+    size_type capacity() const { return mask_ + 1; }
+
+    bool empty() const { return size() == 0; }
+
+    bool full() const { return size() == capacity(); }
+
+private:
+    struct alignas(ring_cache_line_size) position
+    {
+        std::atomic<size_type> value{ 0 };
+    };
+
+private:
+    allocator_type allocator_;
+    cell_allocator_type cell_allocator_;
+    const size_type mask_;
+    std::vector<cell, cell_allocator_type> cells_;
+    position enqueue_pos_;
+    position dequeue_pos_;
+    ring_waiter room_waiter_;
+    ring_waiter data_waiter_;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "ring_buffer.h"
+#include "ring_detail.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Lossy ring for one writer thread and any number of reader threads, e.g. a flight recorder
+ * keeping the newest capacity() values of a trace. push() never blocks or fails: once the ring
+ * is full it overwrites the oldest value. Every value gets the next sequence number, and readers
+ * never hold up the writer; they tell a consistent value from one that was overwritten while
+ * they copied it by the slot's sequence, seqlock style. The slot of sequence s goes to 2s + 1
+ * while the writer stores a value and to 2s + 2 once it is there, so a reader that sees 2s + 2
+ * both before and after copying has value s, and anything else means it was lapped. Values are
+ * copied word by word through relaxed atomics so that the copies racing with the writer are well
+ * defined, hence T must be trivially copyable. The capacity is rounded up to a power of two.
+ */
+template<typename T, typename Allocator = std::allocator<T>>
+class overwrite_ring_buffer
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "overwrite_ring_buffer needs trivially copyable values");
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using sequence_type = std::uint64_t;
+    using allocator_type = Allocator;
+
+private:
+    using word_type = std::uint64_t;
+
+    static constexpr size_type word_count = (sizeof(T) + sizeof(word_type) - 1) / sizeof(word_type);
+
+    struct slot
+    {
+        std::atomic<sequence_type> sequence;
+        std::atomic<word_type> words[word_count];
+    };
+
+    using slot_allocator_type = typename allocator_type::template rebind<slot>::other;
+
+public:
+    overwrite_ring_buffer(size_type capacity, allocator_type allocator = allocator_type())
+        : allocator_{ allocator }
+        , slot_allocator_{ allocator_ }
+        , mask_{ ring_detail::round_up_to_power_of_two(capacity, 1,
+                                                        "overwrite ring needs a capacity")
+                 - 1 }
+        , slots_(mask_ + 1, slot_allocator_) {
+        for (slot & s : slots_)
+            s.sequence.store(0, std::memory_order_relaxed);
+    }
+
+    overwrite_ring_buffer(overwrite_ring_buffer const &) = delete;
+    overwrite_ring_buffer & operator=(overwrite_ring_buffer const &) = delete;
+
+    // Writer side. Stores v, over the oldest value once full, and returns its sequence number.
+    sequence_type push(value_type const & v) {
+        sequence_type const sequence = next_.load(std::memory_order_relaxed);
+        slot & s = slots_[sequence & mask_];
+        word_type words[word_count] = {};
+        std::memcpy(words, &v, sizeof(T));
+        s.sequence.store(2 * sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_type i = 0; i < word_count; ++i)
+            s.words[i].store(words[i], std::memory_order_relaxed);
+        s.sequence.store(2 * sequence + 2, std::memory_order_release);
+        next_.store(sequence + 1, std::memory_order_release);
+        return sequence;
+    }
+
+    // Reader side.
+
+    // Reads the value numbered sequence into v. When that one has been overwritten already,
+    // sequence skips ahead to the oldest value still there, so the caller can count what it
+    // lost, and that one is read instead. False, with v left as it was, once sequence is past
+    // the newest value.
+    bool read(sequence_type & sequence, value_type & v) const {
+        for (;;) {
+            sequence_type const next = next_.load(std::memory_order_acquire);
+            if (sequence >= next)
+                return false;
+            sequence = std::max(sequence, next - std::min<sequence_type>(next, capacity()));
+            if (read_slot(sequence, v))
+                return true;
+            ++sequence;
+        }
+    }
+
+    // Copies up to n of the newest values to out, oldest first, and returns how many. They are
+    // a run without gaps, with the sequence numbers from *first_sequence on, as values that were
+    // overwritten during the copy are left out.
+    size_type snapshot(value_type * out, size_type n,
+                       sequence_type * first_sequence = nullptr) const {
+        sequence_type const next = next_.load(std::memory_order_acquire);
+        n = std::min<size_type>({ n, capacity(), size_type(next) });
+        // Newest first, from the back of out: once one was overwritten so were the older ones.
+        size_type copied = 0;
+        while (copied < n && read_slot(next - 1 - copied, out[n - 1 - copied]))
+            ++copied;
+        if (copied != n && copied != 0)
+            std::memmove(out, out + (n - copied), copied * sizeof(T));
+        if (first_sequence != nullptr)
+            *first_sequence = next - copied;
+        return copied;
+    }
+
+    // Sequence number the next push() gets, also the number of values pushed so far.
+    sequence_type next_sequence() const { return next_.load(std::memory_order_acquire); }
+
+    size_type size() const {
+        return size_type(std::min<sequence_type>(next_sequence(), capacity()));
+    }
+
+    size_type capacity() const { return mask_ + 1; }
+
+    bool empty() const { return next_sequence() == 0; }
+
+private:
+    bool read_slot(sequence_type sequence, value_type & v) const {
+        slot const & s = slots_[sequence & mask_];
+        sequence_type const expected = 2 * sequence + 2;
+        if (s.sequence.load(std::memory_order_acquire) != expected)
+            return false;
+        word_type words[word_count];
+        for (size_type i = 0; i < word_count; ++i)
+            words[i] = s.words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.sequence.load(std::memory_order_relaxed) != expected)
+            return false;
+        std::memcpy(&v, words, sizeof(T));
+        return true;
+    }
+
+private:
+    allocator_type allocator_;
+    slot_allocator_type slot_allocator_;
+    const size_type mask_;
+    std::vector<slot, slot_allocator_type> slots_;
+    alignas(ring_cache_line_size) std::atomic<sequence_type> next_{ 0 };
+};
@@ -1,12 +1,41 @@
 #pragma once
 
+#include "ring_detail.h"
+
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <stdexcept>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+// Producer and consumer state of the lock-free rings is kept this far apart.
+constexpr std::size_t ring_cache_line_size = 64;
+
+// Contiguous run of ring slots.
+template<typename T>
+struct ring_span
+{
+    T * data = nullptr;
+    std::size_t size = 0;
+
+    T * begin() const { return data; }
+    T * end() const { return data + size; }
+};
+
+// A region of a ring: first, then second once the region wraps around, empty otherwise.
+template<typename T>
+struct ring_spans
+{
+    ring_span<T> first;
+    ring_span<T> second;
+
+    std::size_t size() const { return first.size + second.size; }
+};
+
 template<typename T, typename Allocator = std::allocator<T>>
 class ring_buffer
 {
@@ -51,6 +80,13 @@ public:
         }
     }
 
+    // Like push(), but once full the oldest value is destroyed to make room instead of throwing.
+    void push_overwrite(value_type v) {
+        if (full())
+            consume(1);
+        push(std::move(v));
+    }
+
     value_type pop() {
         if (full() || !empty()) {
             T * value_ptr = std::launder(
@@ -71,6 +107,102 @@ public:
         __builtin_unreachable();
     }
 
+    // Pushes as many of the n values from first as there is room for and returns how many. The
+    // free space is at most two contiguous segments, each filled in one go: with memcpy when T
+    // is trivially copyable and first is a pointer to T, element by element otherwise.
+    template<typename InputIt>
+    size_type push_n(InputIt first, size_type n) {
+        n = std::min(n, capacity_ - size());
+        if (n == 0)
+            return 0;
+        size_type const head = cheap_mod_capacity(head_);
+        size_type const first_segment = std::min(n, capacity_ - head);
+        first = ring_detail::construct_n<T>(&buffer_[head], first, first_segment);
+        try {
+            ring_detail::construct_n<T>(&buffer_[0], first, n - first_segment);
+        } catch (...) {
+            ring_detail::destroy_n<T>(&buffer_[head], first_segment);
+            throw;
+        }
+        advance_head(n);
+        return n;
+    }
+
+    // Moves up to n values out to out, oldest first, and returns how many. Like push_n(), in
+    // at most two segments, with memcpy when T is trivially copyable and out a pointer to T.
+    template<typename OutputIt>
+    size_type pop_n(OutputIt out, size_type n) {
+        n = std::min(n, size());
+        if (n == 0)
+            return 0;
+        size_type const tail = cheap_mod_capacity(tail_);
+        size_type const first_segment = std::min(n, capacity_ - tail);
+        size_type done = 0;
+        try {
+            out = ring_detail::move_out_n<T>(&buffer_[tail], first_segment, out, done);
+            ring_detail::move_out_n<T>(&buffer_[0], n - first_segment, out, done);
+        } catch (...) {
+            // The values moved out before the one that threw are gone from the ring.
+            if (done != 0)
+                advance_tail(done);
+            throw;
+        }
+        advance_tail(n);
+        return n;
+    }
+
+    // Oldest value, left in the ring.
+    value_type & front() {
+        if (empty())
+            throw std::underflow_error("ring underflow");
+        return *slot(cheap_mod_capacity(tail_));
+    }
+
+    // Value i places after the oldest one, nullptr past the last one.
+    value_type * peek(size_type i = 0) {
+        if (i >= size())
+            return nullptr;
+        return slot(cheap_mod_capacity(cheap_mod_capacity(tail_) + i));
+    }
+
+    // The values in the ring, oldest first, left in place until consume().
+    ring_spans<value_type> readable_spans() {
+        size_type const n = size();
+        size_type const tail = cheap_mod_capacity(tail_);
+        size_type const first_segment = std::min(n, capacity_ - tail);
+        return { { storage(tail), first_segment }, { storage(0), n - first_segment } };
+    }
+
+    // Destroys the n oldest values.
+    void consume(size_type n) {
+        if (n > size())
+            throw std::underflow_error("ring underflow");
+        if (n == 0)
+            return;
+        size_type const tail = cheap_mod_capacity(tail_);
+        size_type const first_segment = std::min(n, capacity_ - tail);
+        ring_detail::destroy_n<T>(&buffer_[tail], first_segment);
+        ring_detail::destroy_n<T>(&buffer_[0], n - first_segment);
+        advance_tail(n);
+    }
+
+    // The free slots, in the order they are filled. Values are constructed there in place,
+    // plain writes are enough for trivially copyable types, then published with commit().
+    ring_spans<value_type> writable_spans() {
+        size_type const n = capacity_ - size();
+        size_type const head = cheap_mod_capacity(head_);
+        size_type const first_segment = std::min(n, capacity_ - head);
+        return { { storage(head), first_segment }, { storage(0), n - first_segment } };
+    }
+
+    // Adds the values constructed in the first n slots of writable_spans().
+    void commit(size_type n) {
+        if (n > capacity_ - size())
+            throw std::overflow_error("ring overflow");
+        if (n != 0)
+            advance_head(n);
+    }
+
     size_type size() const {
         if (full()) {
             return capacity_;
@@ -90,6 +222,24 @@ public:
     bool full() const { return full_; }
 
 private:
+    T * slot(size_type idx) { return std::launder(reinterpret_cast<T *>(&buffer_[idx])); }
+
+    T * storage(size_type idx) { return reinterpret_cast<T *>(buffer_.data() + idx); }
+
+    void advance_head(size_type n) {
+        head_ = cheap_mod_capacity(head_) + n;
+        normalize_idx();
+        empty_ = false;
+        full_ = tail_ == head_;
+    }
+
+    void advance_tail(size_type n) {
+        tail_ = cheap_mod_capacity(tail_) + n;
+        normalize_idx();
+        full_ = false;
+        empty_ = tail_ == head_;
+    }
+
     size_type increment_and_check(size_type & cursor) {
         size_type result = cursor++;
         normalize_idx();
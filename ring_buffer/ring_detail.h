@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Helpers shared by the rings. The element helpers work on arrays of aligned storage for T,
+// slots holds the first of n consecutive ones.
+namespace ring_detail
+{
+
+// Whether values of T move between the ring and It with a single memcpy.
+template<typename T, typename It>
+constexpr bool is_memcpy_iterator =
+    std::is_trivially_copyable<T>::value && std::is_pointer<It>::value
+    && std::is_same<typename std::remove_cv<typename std::remove_pointer<It>::type>::type,
+                    T>::value;
+
+template<typename T, typename Storage>
+T * slot(Storage * slots, std::size_t i) {
+    return std::launder(reinterpret_cast<T *>(slots + i));
+}
+
+template<typename T, typename Storage>
+void destroy_n(Storage * slots, std::size_t n) {
+    if constexpr (!std::is_trivially_destructible<T>::value) {
+        for (std::size_t i = 0; i < n; ++i)
+            slot<T>(slots, i)->T::~T();
+    }
+}
+
+// Copy-constructs n values from first, returns first past them. Nothing is left constructed
+// when one of them throws.
+template<typename T, typename Storage, typename InputIt>
+InputIt construct_n(Storage * slots, InputIt first, std::size_t n) {
+    if constexpr (is_memcpy_iterator<T, InputIt>) {
+        if (n != 0)
+            std::memcpy(slots, first, n * sizeof(T));
+        return first + n;
+    } else {
+        std::size_t done = 0;
+        try {
+            for (; done < n; ++done, ++first)
+                new (slots + done) T(*first);
+        } catch (...) {
+            destroy_n<T>(slots, done);
+            throw;
+        }
+        return first;
+    }
+}
+
+// Moves n values out to out and destroys them. Counts in done the values moved out and
+// destroyed, so a throw leaves it at the one that threw, still in its slot.
+template<typename T, typename Storage, typename OutputIt>
+OutputIt move_out_n(Storage * slots, std::size_t n, OutputIt out, std::size_t & done) {
+    if constexpr (is_memcpy_iterator<T, OutputIt>) {
+        if (n != 0)
+            std::memcpy(out, slots, n * sizeof(T));
+        done += n;
+        return out + n;
+    } else {
+        for (std::size_t i = 0; i < n; ++i, ++out, ++done) {
+            *out = std::move(*slot<T>(slots, i));
+            slot<T>(slots, i)->T::~T();
+        }
+        return out;
+    }
+}
+
+// Smallest power of two of at least x and minimum, for the masked rings. A ring of 0 slots
+// is rejected with what.
+inline std::size_t round_up_to_power_of_two(std::size_t x, std::size_t minimum,
+                                            char const * what) {
+    if (x == 0)
+        throw std::invalid_argument(what);
+    std::size_t result = minimum;
+    while (result < x)
+        result <<= 1;
+    return result;
+}
+
+}  // namespace ring_detail
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "ring_buffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#ifdef __linux__
+#include <ctime>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/*
+ * Where the threads blocked on one side of a ring wait to be notified by the other side. A
+ * waiter spins on its operation for a while, then registers as a sleeper and parks on a futex
+ * (on a condition variable elsewhere) until the epoch moves. The other side calls notify() after
+ * every operation that can unblock a waiter, and the epoch is only bumped and the futex only
+ * woken when someone sleeps. Both sides need a full barrier between their write (the ring index,
+ * the sleeper count) and their read of the other's, so that either the waiter sees the new index
+ * or the notifier sees the sleeper. A fence in every push and pop would cost more than the rest
+ * of them, so where Linux has membarrier() the waiter, which is about to sleep anyway, pays for
+ * both: the syscall puts a barrier into every running thread of the process, and notify() is left
+ * with a compiler barrier and a load.
+ */
+class alignas(ring_cache_line_size) ring_waiter
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    static constexpr int spin_count = 128;
+
+    template<typename Rep, typename Period>
+    static clock_type::time_point deadline_after(std::chrono::duration<Rep, Period> timeout) {
+        return clock_type::now() + std::chrono::duration_cast<clock_type::duration>(timeout);
+    }
+
+    ring_waiter() : asymmetric_{ asymmetric_barrier_available() } {}
+
+    // Retries attempt() until it succeeds, or until deadline when there is one.
+    template<typename Attempt>
+    bool wait(Attempt && attempt, clock_type::time_point const * deadline = nullptr) {
+        for (int i = 0; i < spin_count; ++i) {
+            if (attempt())
+                return true;
+            if (i >= spin_count / 2)
+                std::this_thread::yield();
+        }
+        for (;;) {
+            std::uint32_t const epoch = epoch_.load(std::memory_order_acquire);
+            sleepers_.fetch_add(1, std::memory_order_relaxed);
+            heavy_barrier();
+            if (attempt()) {
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+            bool const woken = park(epoch, deadline);
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            if (!woken)
+                return attempt();
+        }
+    }
+
+    void notify() {
+        if (asymmetric_)
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        else
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) == 0)
+            return;
+#ifdef __linux__
+        epoch_.fetch_add(1, std::memory_order_release);
+        ::syscall(SYS_futex, &epoch_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            epoch_.fetch_add(1, std::memory_order_release);
+        }
+        woken_.notify_one();
+#endif
+    }
+
+private:
+    static bool asymmetric_barrier_available() {
+#ifdef __linux__
+        static bool const registered =
+            ::syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+        return registered;
+#else
+        return false;
+#endif
+    }
+
+    void heavy_barrier() {
+#ifdef __linux__
+        if (asymmetric_ && ::syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0)
+            return;
+#endif
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // Sleeps while the epoch is still epoch; false once the deadline has passed.
+    bool park(std::uint32_t epoch, clock_type::time_point const * deadline) {
+#ifdef __linux__
+        timespec timeout{};
+        if (deadline != nullptr) {
+            auto const left = *deadline - clock_type::now();
+            if (left <= clock_type::duration::zero())
+                return false;
+            auto const seconds = std::chrono::duration_cast<std::chrono::seconds>(left);
+            timeout.tv_sec = time_t(seconds.count());
+            timeout.tv_nsec = long(std::chrono::nanoseconds(left - seconds).count());
+        }
+        ::syscall(SYS_futex, &epoch_, FUTEX_WAIT_PRIVATE, epoch,
+                  deadline != nullptr ? &timeout : nullptr, nullptr, 0);
+        return deadline == nullptr || clock_type::now() < *deadline;
+#else
+        std::unique_lock<std::mutex> lock{ mutex_ };
+        auto const moved = [&] { return epoch_.load(std::memory_order_relaxed) != epoch; };
+        if (deadline == nullptr) {
+            woken_.wait(lock, moved);
+            return true;
+        }
+        return woken_.wait_until(lock, *deadline, moved);
+#endif
+    }
+
+private:
+    std::atomic<std::uint32_t> epoch_{ 0 };
+    std::atomic<std::uint32_t> sleepers_{ 0 };
+    bool const asymmetric_;
+#ifndef __linux__
+    std::mutex mutex_;
+    std::condition_variable woken_;
+#endif
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "ring_buffer.h"
+#include "ring_waiter.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Lock-free ring for exactly one producer thread and one consumer thread. Each side owns its
+ * index and publishes it with a release store; the other side reads it with an acquire load, so
+ * an element is fully constructed before it can be popped and fully destroyed before its slot
+ * can be reused. Each side also keeps a copy of the other side's index and only reloads it when
+ * that copy says the ring is full (or empty), so as long as there is room (or data) a push or a
+ * pop only touches its own cache line and the slot. One slot is left unused to tell a full ring
+ * from an empty one. The _wait calls block instead of failing: they spin for a bit, then sleep
+ * until the other side makes room (or data) and notifies, which it only does for a sleeper.
+ */
+template<typename T, typename Allocator = std::allocator<T>>
+class spsc_ring_buffer
+{
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using allocator_type = Allocator;
+    using storage_item_type = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+private:
+    using storage_item_allocator_type =
+        typename allocator_type::template rebind<storage_item_type>::other;
+
+public:
+    spsc_ring_buffer(size_type capacity, allocator_type allocator = allocator_type())
+        : allocator_{ allocator }
+        , storage_item_allocator_{ allocator_ }
+        , slots_{ capacity + 1 }
+        , buffer_{ slots_, storage_item_type{}, storage_item_allocator_ } {}
+
+    spsc_ring_buffer(spsc_ring_buffer const &) = delete;
+    spsc_ring_buffer & operator=(spsc_ring_buffer const &) = delete;
+
+    ~spsc_ring_buffer() {
+        size_type const head = producer_.head.load(std::memory_order_acquire);
+        for (size_type tail = consumer_.tail.load(std::memory_order_relaxed); tail != head;
+             tail = increment(tail))
+            std::launder(reinterpret_cast<T *>(&buffer_[tail]))->T::~T();
+    }
+
+    // Producer side.
+
+    template<typename... Args>
+    bool try_emplace(Args &&... args) {
+        size_type const head = producer_.head.load(std::memory_order_relaxed);
+        size_type const next = increment(head);
+        if (!has_room(next))
+            return false;
+        new (&buffer_[head]) value_type(std::forward<Args>(args)...);
+        producer_.head.store(next, std::memory_order_release);
+        data_waiter_.notify();
+        return true;
+    }
+
+    bool try_push(value_type const & v) { return try_emplace(v); }
+
+    bool try_push(value_type && v) { return try_emplace(std::move(v)); }
+
+    void push(value_type v) {
+        if (!try_emplace(std::move(v)))
+            throw std::overflow_error("ring overflow");
+    }
+
+    void push_wait(value_type const & v) { push_wait_until(v, nullptr); }
+
+    void push_wait(value_type && v) { push_wait_until(std::move(v), nullptr); }
+
+    // False, with v left as it was, when the ring is still full after timeout.
+    template<typename Rep, typename Period>
+    bool push_wait_for(value_type const & v, std::chrono::duration<Rep, Period> timeout) {
+        auto const deadline = ring_waiter::deadline_after(timeout);
+        return push_wait_until(v, &deadline);
+    }
+
+    template<typename Rep, typename Period>
+    bool push_wait_for(value_type && v, std::chrono::duration<Rep, Period> timeout) {
+        auto const deadline = ring_waiter::deadline_after(timeout);
+        return push_wait_until(std::move(v), &deadline);
+    }
+
+    // Consumer side.
+
+    bool try_pop(value_type & v) {
+        size_type const tail = consumer_.tail.load(std::memory_order_relaxed);
+        if (!has_data(tail))
+            return false;
+        T * value_ptr = std::launder(reinterpret_cast<T *>(&buffer_[tail]));
+        v = std::move(*value_ptr);
+        value_ptr->T::~T();
+        consumer_.tail.store(increment(tail), std::memory_order_release);
+        room_waiter_.notify();
+        return true;
+    }
+
+    value_type pop() {
+        size_type const tail = consumer_.tail.load(std::memory_order_relaxed);
+        if (!has_data(tail))
+            throw std::underflow_error("ring underflow");
+        T * value_ptr = std::launder(reinterpret_cast<T *>(&buffer_[tail]));
+        value_type result = std::move(*value_ptr);
+        value_ptr->T::~T();
+        consumer_.tail.store(increment(tail), std::memory_order_release);
+        room_waiter_.notify();
+        return result;
+    }
+
+    value_type pop_wait() {
+        data_waiter_.wait(
+            [this] { return has_data(consumer_.tail.load(std::memory_order_relaxed)); });
+        return pop();
+    }
+
+    // False, with v left as it was, when the ring is still empty after timeout.
+    template<typename Rep, typename Period>
+    bool pop_wait_for(value_type & v, std::chrono::duration<Rep, Period> timeout) {
+        auto const deadline = ring_waiter::deadline_after(timeout);
+        return data_waiter_.wait([&] { return try_pop(v); }, &deadline);
+    }
+
+    // Either side; exact only when the other side is idle.
+
+    size_type size() const {
+        size_type const head = producer_.head.load(std::memory_order_acquire);
+        size_type const tail = consumer_.tail.load(std::memory_order_acquire);
+        return head >= tail ? head - tail : head + (slots_ - tail);
+    }
+
+    size_type capacity() const { return slots_ - 1; }
+
+    bool empty() const { return size() == 0; }
+
+    bool full() const { return size() == capacity(); }
+
+private:
+    size_type increment(size_type idx) const {
+        ++idx;
+        return idx == slots_ ? 0 : idx;
+    }
+
+    template<typename V>
+    bool push_wait_until(V && v, ring_waiter::clock_type::time_point const * deadline) {
+        return room_waiter_.wait([&] { return try_emplace(std::forward<V>(v)); }, deadline);
+    }
+
+    bool has_room(size_type next) {
+        if (next == producer_.cached_tail)
+            producer_.cached_tail = consumer_.tail.load(std::memory_order_acquire);
+        return next != producer_.cached_tail;
+    }
+
+    bool has_data(size_type tail) {
+        if (tail == consumer_.cached_head)
+            consumer_.cached_head = producer_.head.load(std::memory_order_acquire);
+        return tail != consumer_.cached_head;
+    }
+
+    struct alignas(ring_cache_line_size) producer_state
+    {
+        std::atomic<size_type> head{ 0 };
+        size_type cached_tail = 0;
+    };
+
+    struct alignas(ring_cache_line_size) consumer_state
+    {
+        std::atomic<size_type> tail{ 0 };
+        size_type cached_head = 0;
+    };
+
+private:
+    allocator_type allocator_;
+    storage_item_allocator_type storage_item_allocator_;
+    const size_type slots_;
+    std::vector<storage_item_type, storage_item_allocator_type> buffer_;
+    producer_state producer_;
+    consumer_state consumer_;
+    ring_waiter room_waiter_;
+    ring_waiter data_waiter_;
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "ring_detail.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/*
+ * ring_buffer with its capacity fixed at compile time and its storage inline, for small rings
+ * kept in large numbers. head and tail are free-running counters: the slot of a counter is the
+ * counter modulo N, a mask when N is a power of two, and the size is head - tail, so there are
+ * no flags to keep up and no wraparound branches. Unsigned overflow of the counters is harmless
+ * when N is a power of two that divides 2^32, they are 32 bits then, and 64 bits otherwise.
+ */
+template<typename T, std::size_t N>
+class static_ring_buffer
+{
+    static_assert(N > 0, "static_ring_buffer needs a capacity");
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using storage_item_type = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+private:
+    static constexpr bool power_of_two = (N & (N - 1)) == 0;
+    using index_type = typename std::conditional<power_of_two && N <= (std::size_t(1) << 31),
+                                                 std::uint32_t, std::size_t>::type;
+
+public:
+    static_ring_buffer() = default;
+
+    static_ring_buffer(static_ring_buffer const & other) { copy_from(other); }
+
+    static_ring_buffer(static_ring_buffer && other) noexcept(
+        std::is_nothrow_move_constructible<T>::value) {
+        move_from(other);
+    }
+
+    static_ring_buffer & operator=(static_ring_buffer const & other) {
+        if (this != &other) {
+            clear();
+            copy_from(other);
+        }
+        return *this;
+    }
+
+    static_ring_buffer & operator=(static_ring_buffer && other) noexcept(
+        std::is_nothrow_move_constructible<T>::value) {
+        if (this != &other) {
+            clear();
+            move_from(other);
+        }
+        return *this;
+    }
+
+    ~static_ring_buffer() { clear(); }
+
+    template<typename... Args>
+    void emplace(Args &&... args) {
+        if (full())
+            throw std::overflow_error("ring overflow");
+        new (&buffer_[index(head_)]) value_type(std::forward<Args>(args)...);
+        ++head_;
+    }
+
+    void push(value_type v) { emplace(std::move(v)); }
+
+    value_type pop() {
+        if (empty())
+            throw std::underflow_error("ring underflow");
+        T * value_ptr = slot(index(tail_));
+        value_type result = std::move(*value_ptr);
+        value_ptr->T::~T();
+        ++tail_;
+        return result;
+    }
+
+    // As ring_buffer::push_n() and pop_n().
+    template<typename InputIt>
+    size_type push_n(InputIt first, size_type n) {
+        n = std::min(n, N - size());
+        size_type const head = index(head_);
+        size_type const first_segment = std::min(n, N - head);
+        first = ring_detail::construct_n<T>(&buffer_[head], first, first_segment);
+        try {
+            ring_detail::construct_n<T>(&buffer_[0], first, n - first_segment);
+        } catch (...) {
+            ring_detail::destroy_n<T>(&buffer_[head], first_segment);
+            throw;
+        }
+        head_ += index_type(n);
+        return n;
+    }
+
+    template<typename OutputIt>
+    size_type pop_n(OutputIt out, size_type n) {
+        n = std::min(n, size());
+        size_type const tail = index(tail_);
+        size_type const first_segment = std::min(n, N - tail);
+        size_type done = 0;
+        try {
+            out = ring_detail::move_out_n<T>(&buffer_[tail], first_segment, out, done);
+            ring_detail::move_out_n<T>(&buffer_[0], n - first_segment, out, done);
+        } catch (...) {
+            // The values moved out before the one that threw are gone from the ring.
+            tail_ += index_type(done);
+            throw;
+        }
+        tail_ += index_type(n);
+        return n;
+    }
+
+    void clear() {
+        if constexpr (!std::is_trivially_destructible<T>::value) {
+            for (; tail_ != head_; ++tail_)
+                slot(index(tail_))->T::~T();
+        }
+        tail_ = head_;
+    }
+
+    size_type size() const { return index_type(head_ - tail_); }
+
+    static constexpr size_type capacity() { return N; }
+
+    bool empty() const { return head_ == tail_; }
+
+    bool full() const { return size() == N; }
+
+private:
+    static size_type index(index_type counter) {
+        if constexpr (power_of_two)
+            return counter & (N - 1);
+        else
+            return counter % N;
+    }
+
+    T * slot(size_type idx) { return std::launder(reinterpret_cast<T *>(&buffer_[idx])); }
+
+    T const * slot(size_type idx) const {
+        return std::launder(reinterpret_cast<T const *>(&buffer_[idx]));
+    }
+
+    void copy_from(static_ring_buffer const & other) {
+        for (index_type i = other.tail_; i != other.head_; ++i)
+            emplace(*other.slot(index(i)));
+    }
+
+    void move_from(static_ring_buffer & other) {
+        for (index_type i = other.tail_; i != other.head_; ++i)
+            emplace(std::move(*other.slot(index(i))));
+        other.clear();
+    }
+
+private:
+    storage_item_type buffer_[N];
+    index_type head_ = 0;
+    index_type tail_ = 0;
+};